@@ -0,0 +1,212 @@
+/* Authors: Berck Nash, Elijah Ricca
+   Class: Applied Cryptography, Spring 2012
+   file: arena.c
+
+   Bump allocator for large message buffers.  Memory comes from mmap in
+   chunks that are huge-page backed where possible (MAP_HUGETLB, falling
+   back to transparent huge pages via madvise) and preferred on the NUMA
+   node of the thread that creates the arena.  Allocations are 64-byte
+   aligned and are released all at once by arena_reset, which keeps up to
+   ARENA_KEEP bytes of chunks mapped for the next message and unmaps the
+   rest, so one very large message doesn't pin its memory for the life of
+   the arena.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "ccm.h"
+
+#define HUGE_PAGE (2UL << 20)
+#define ARENA_ALIGN 64
+#define ARENA_KEEP (32UL << 20) //chunk bytes kept mapped across a reset
+
+typedef struct arena_chunk {
+     struct arena_chunk *next;
+     unsigned char *base;
+     size_t size, used;
+} arena_chunk_t;
+
+struct arena {
+     arena_chunk_t *head, *cur;
+     size_t chunk_size;
+     int node; //NUMA node chunks are preferred on, -1 if unknown
+};
+
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static int current_node(void)
+{
+     unsigned cpu, node;
+     if (syscall(SYS_getcpu, &cpu, &node, NULL))
+	  return -1;
+     return node;
+}
+
+/* Map size bytes (a multiple of HUGE_PAGE), preferring explicit huge
+   pages, then transparent ones, and ask the kernel to place them on node
+   before they are first touched.  Kernels before 6.7 don't align plain
+   anonymous mappings, and THP can only back aligned 2 MB ranges, so the
+   fallback maps an extra huge page and trims both ends to the boundary. */
+static void *map_chunk(size_t size, int node)
+{
+     void *p;
+     unsigned long mask;
+     uintptr_t start, aligned;
+
+     p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+     if (p == MAP_FAILED) {
+	  p = mmap(NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	  if (p == MAP_FAILED)
+	       return NULL;
+	  start = (uintptr_t) p;
+	  aligned = (start + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	  if (aligned > start)
+	       munmap(p, aligned - start);
+	  if (start + HUGE_PAGE > aligned)
+	       munmap((void *) (aligned + size), start + HUGE_PAGE - aligned);
+	  p = (void *) aligned;
+	  madvise(p, size, MADV_HUGEPAGE);
+     }
+
+     /* best effort: fails harmlessly on kernels without NUMA support */
+     if (node >= 0 && node < 8 * (int) sizeof(mask)) {
+	  mask = 1UL << node;
+	  syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0);
+     }
+     errno = 0; //don't leave a fallback's failure for error() to report
+     return p;
+}
+
+static arena_chunk_t *chunk_new(arena_t *arena, size_t min)
+{
+     arena_chunk_t *chunk;
+     size_t size = arena->chunk_size;
+
+     if (size < min)
+	  size = (min + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+
+     chunk = malloc(sizeof(arena_chunk_t));
+     if (!chunk)
+	  fatal("Error allocating memory for arena chunk.");
+     chunk->base = map_chunk(size, arena->node);
+     if (!chunk->base)
+	  fatal("Error mapping memory for arena chunk.");
+     chunk->size = size;
+     chunk->used = 0;
+     chunk->next = NULL;
+     return chunk;
+}
+
+arena_t *arena_new(size_t chunk_size)
+{
+     arena_t *arena;
+
+     arena = malloc(sizeof(arena_t));
+     if (!arena)
+	  fatal("Error allocating memory for arena.");
+     if (chunk_size < HUGE_PAGE)
+	  chunk_size = HUGE_PAGE;
+     arena->chunk_size = (chunk_size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+     arena->node = current_node();
+     arena->head = arena->cur = chunk_new(arena, 0);
+     return arena;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+     arena_chunk_t *chunk = arena->cur;
+     void *p;
+
+     size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+     if (chunk->size - chunk->used < size) {
+	  /* reuse chunks kept from before the last reset, or add one */
+	  while (chunk->next && chunk->next->size < size)
+	       chunk = chunk->next;
+	  if (chunk->next) {
+	       chunk = chunk->next;
+	       chunk->used = 0;
+	  }
+	  else {
+	       chunk->next = chunk_new(arena, size);
+	       chunk = chunk->next;
+	  }
+	  arena->cur = chunk;
+     }
+     p = chunk->base + chunk->used;
+     chunk->used += size;
+     return p;
+}
+
+void arena_reset(arena_t *arena)
+{
+     arena_chunk_t *chunk, *next;
+     size_t kept = arena->head->size;
+
+     /* keep the first ARENA_KEEP bytes of chunks, unmap the rest */
+     for (chunk = arena->head; chunk->next; ) {
+	  next = chunk->next;
+	  if (kept + next->size <= ARENA_KEEP) {
+	       kept += next->size;
+	       chunk = next;
+	       continue;
+	  }
+	  chunk->next = next->next;
+	  munmap(next->base, next->size);
+	  free(next);
+     }
+     arena->cur = arena->head;
+     arena->head->used = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+     arena_chunk_t *chunk, *next;
+
+     if (!arena)
+	  return;
+     for (chunk = arena->head; chunk; chunk = next) {
+	  next = chunk->next;
+	  munmap(chunk->base, chunk->size);
+	  free(chunk);
+     }
+     free(arena);
+}
+
+static void thread_arena_free(void *arena)
+{
+     arena_free(arena);
+}
+
+static void thread_key_create(void)
+{
+     if (pthread_key_create(&thread_key, thread_arena_free))
+	  fatal("Error creating thread arena key.");
+}
+
+/* per-thread scratch arena used inside ccm_encrypt/ccm_decrypt, created on
+   first use and unmapped when the thread exits.  It is reset before they
+   return, so it must never be passed to them as input->arena. */
+arena_t *arena_thread(void)
+{
+     arena_t *arena;
+
+     pthread_once(&thread_once, thread_key_create);
+     arena = pthread_getspecific(thread_key);
+     if (!arena) {
+	  arena = arena_new(ARENA_CHUNK);
+	  pthread_setspecific(thread_key, arena);
+     }
+     return arena;
+}
@@ -9,9 +9,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <openssl/aes.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
 #include "ccm.h"
 
+/* largest run of counter blocks handed to a single EVP_EncryptUpdate call,
+   which takes an int length */
+#define EVP_MAX_BLOCKS (1 << 20)
+
+typedef struct keystream_job {
+     struct keystream_job *next; //pool queue
+     unsigned char *s, *ctr;
+     unsigned long num_ctr;
+     ccm_key_t *key;
+     int evp;
+     int *pending; //jobs of the same keystream() call not yet finished
+} keystream_job_t;
+
+/* keystream worker threads, started once and shared by every caller */
+static struct {
+     pthread_mutex_t lock;
+     pthread_cond_t work, done;
+     keystream_job_t *queue;
+     int workers;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0 };
+
 unsigned char* ccm_encrypt(int *c_len, ccm_t *input)
 {
      unsigned char *key = input -> key;
@@ -26,7 +50,13 @@ unsigned char* ccm_encrypt(int *c_len, ccm_t *input)
      unsigned char **blocks, **ctr;
      unsigned char flags = 0;
      unsigned char *c; //ciphertext
-     AES_KEY aes_key;
+     ccm_key_t key_buf, *prepared = input -> prepared;
+     arena_t *scratch = arena_thread(); //reset before returning
+
+     ccm_init(NULL);
+     if (input -> arena == scratch)
+	  fatal("The thread's scratch arena can't hold the ciphertext.");
+     TRACE(TRACE_START, TRACE_ENCRYPT, p_len, a_len);
 
      /* determine number of blocks to allocate */
      if (a_len) {
@@ -40,25 +70,18 @@ unsigned char* ccm_encrypt(int *c_len, ccm_t *input)
      unsigned long num_ctr = 1 + ((p_len + 15) / 16);
      unsigned long num_blocks = ((a_len + extrabytes + 15) / 16) + num_ctr;
 
-     /* allocate input blocks */
-     blocks = calloc(num_blocks, sizeof(char*));
-     if (!blocks)
-	  fatal("Error allocating memory for input blocks.");
-     for (i=0; i < num_blocks; i++) {
-	  blocks[i] = calloc(16, sizeof(char));
-	  if (!blocks[i])
-	       fatal("Error allocating memory for input blocks.");
-     }
+     /* allocate input blocks; format writes every byte of them */
+     blocks = arena_alloc(scratch, num_blocks * sizeof(char*));
+     blocks[0] = arena_alloc(scratch, 16 * num_blocks);
+     for (i=1; i < num_blocks; i++)
+	  blocks[i] = blocks[0] + 16*i;
 
-     /* allocate counter blocks */
-     ctr = calloc(num_ctr, sizeof(char*));
-     if (!ctr)
-	  fatal("Error allocating memory for input blocks.");
-     for (i=0; i < num_ctr; i++) {
-	  ctr[i] = calloc(16, sizeof(char));
-	  if (!ctr[i])
-	       fatal("Error allocating memory for input blocks.");
-     }
+     /* allocate counter blocks, contiguous so the keystream can be
+	generated in bulk */
+     ctr = arena_alloc(scratch, num_ctr * sizeof(char*));
+     ctr[0] = arena_alloc(scratch, 16 * num_ctr);
+     for (i=1; i < num_ctr; i++)
+	  ctr[i] = ctr[0] + 16*i;
 
      /* set a_len bit of flag (1 if there's any a_data, 0 otherwise)*/
      if (a_len)
@@ -90,25 +113,27 @@ unsigned char* ccm_encrypt(int *c_len, ccm_t *input)
      /* generate CTR blocks */
      gen_ctr(ctr, num_ctr, nonce, n_len, flags);
 
-     if (AES_set_encrypt_key(key, 128, &aes_key))
-	  fatal("Error initializing AES key.");
+     /* prepare the key for this message unless the caller passed one */
+     if (!prepared) {
+	  ccm_key_init(&key_buf, key, NULL);
+	  prepared = &key_buf;
+     }
+     TRACE(TRACE_STAGE, TRACE_ENCRYPT, STAGE_FORMAT, 0);
 
 /* --calculate tag-- */
      unsigned char *y0, *y1, *ybuff, *ytemp;
-     y0 = calloc(16, sizeof(char));
-     y1 = calloc(16, sizeof(char));
-     ybuff = calloc(16, sizeof(char));
-     if (!y0 || !y1 || !ybuff)
-	  fatal("Error allocating memory for Y buffer.");
+     y0 = arena_alloc(scratch, 16);
+     y1 = arena_alloc(scratch, 16);
+     ybuff = arena_alloc(scratch, 16);
 
-     AES_encrypt(blocks[0], y0, &aes_key);
+     AES_encrypt(blocks[0], y0, &prepared->schedule);
 
      /* XOR each block with the previous encrypted input block, and encrypt
 	This is done in two 64-bit segments for efficiency */
      for (i=1; i<num_blocks; i++) {
 	  *((uint64_t *) ybuff) = *((uint64_t*) blocks[i]) ^ *((uint64_t*) y0);
 	  *((uint64_t *) (ybuff+8)) = *((uint64_t*) (blocks[i]+8)) ^ *((uint64_t*) (y0+8));
-	  AES_encrypt(ybuff, y1, &aes_key);
+	  AES_encrypt(ybuff, y1, &prepared->schedule);
 
 	  /* swap buffers for next round, don't lose references */
 	  ytemp = y0;
@@ -118,30 +143,28 @@ unsigned char* ccm_encrypt(int *c_len, ccm_t *input)
 
 /* copy t_len most significant bits of last round to tag */
      unsigned char *tag;
-     tag = calloc(t_len, sizeof(char));
+     tag = arena_alloc(scratch, t_len);
      memcpy(tag, y0, t_len);
 
-     free(y0);
-     free(y1);
-     free(ybuff);
+     TRACE(TRACE_STAGE, TRACE_ENCRYPT, STAGE_MAC, 0);
 
 /* --calculate S blocks -- */
      unsigned char **s;
-     s = calloc(num_ctr, sizeof(char*));
-     if (!s)
-	  fatal("Error allocating memory for S blocks.");
-     for (i=0; i < num_ctr; i++) {
-	  s[i] = malloc(16);
-	  if (!s[i])
-	       fatal("Error allocating memory for S blocks.");
-     }
-     for (i=0; i < num_ctr; i++)
-	  AES_encrypt(ctr[i], s[i], &aes_key);
+     s = arena_alloc(scratch, num_ctr * sizeof(char*));
+     s[0] = arena_alloc(scratch, 16 * num_ctr);
+     for (i=1; i < num_ctr; i++)
+	  s[i] = s[0] + 16*i;
+
+     keystream(s[0], ctr[0], num_ctr, prepared);
+     TRACE(TRACE_STAGE, TRACE_ENCRYPT, STAGE_KEYSTREAM, 0);
 
 /* --calculate ciphertext-- */
      *c_len = p_len + t_len;
-     c = malloc(*c_len);
-     if (!c)
+     if (input -> out)
+	  c = input -> out;
+     else if (input -> arena)
+	  c = arena_alloc(input -> arena, *c_len);
+     else if (!(c = malloc(*c_len)))
 	  fatal("Error allocating memory for ciphertext.");
 
      int p_rem = p_len;
@@ -161,53 +184,15 @@ unsigned char* ccm_encrypt(int *c_len, ccm_t *input)
      /* append tag */
      for (i=0; i< t_len; i++)
 	  *(c+p_len+i) = *(tag+i) ^ *(s[0]+i);
+     TRACE(TRACE_STAGE, TRACE_ENCRYPT, STAGE_XOR, 0);
 
-/* debug prints */
-#ifdef DEBUG
-     printf("\n");
-     for (i=0; i < num_blocks; i++) {
-	  printf("B%d:\t", i);
-	  print_block(blocks[i]);
-     }
-     printf("\n");
-     for (i=0; i < num_ctr; i++) {
-	  printf("C%d:\t", i);
-	  print_block(ctr[i]);
-     }
-     printf("\n");
-     printf("T:\t");
-     for (i=0; i < t_len; i++) {
-	  printf("%02x", tag[i]);
-	  if (!((i+1) % 4))
-	       printf(" ");
-     }
-     printf("\n");
-     printf("\n");
-     for (i=0; i < num_ctr; i++) {
-	  printf("S%d:\t", i);
-	  print_block(s[i]);
-     }
-     printf("\n");
-     printf("C:\t");
-     for (i=0; i < *c_len; i++) {
-	  printf("%02x", c[i]);
-	  if (!((i+1) % 4))
-	       printf(" ");
-     }
-     printf("\n");
-#endif
-    
-/* free memory */
-     for (i=0; i < num_blocks; i++) 
-	  free (blocks[i]);
-     free (blocks);
-     for (i=0; i < num_ctr; i++)
-	  free (ctr[i]);
-     free (ctr);
-     for (i=0; i < num_ctr; i++)
-	  free (s[i]);
-     free (s);
-    
+
+/* release scratch memory */
+     arena_reset(scratch);
+     if (prepared == &key_buf)
+	  ccm_key_cleanup(&key_buf);
+
+     TRACE(TRACE_END, TRACE_ENCRYPT, *c_len, 0);
      return c;
 }
 
@@ -329,6 +314,184 @@ void gen_ctr(unsigned char **ctr, int num_ctr, unsigned char *nonce, unsigned lo
      }
 }
 
+/* Prepare the 16-byte key, using schedule if it was already expanded
+   (e.g. by aes_expand_batch). */
+void ccm_key_init(ccm_key_t *k, unsigned char *key, AES_KEY *schedule)
+{
+     memset(k, 0, sizeof(ccm_key_t));
+     if (!key)
+	  fatal("Error initializing AES key.");
+     memcpy(k->key, key, 16);
+     if (schedule)
+	  k->schedule = *schedule;
+     else if (AES_set_encrypt_key(key, 128, &k->schedule))
+	  fatal("Error initializing AES key.");
+     pthread_mutex_init(&k->lock, NULL);
+}
+
+void ccm_key_cleanup(ccm_key_t *k)
+{
+     int i;
+
+     for (i=0; i < k->nspare; i++)
+	  EVP_CIPHER_CTX_free(k->spare[i]);
+     free(k->spare);
+     pthread_mutex_destroy(&k->lock);
+     OPENSSL_cleanse(k, sizeof(ccm_key_t));
+}
+
+/* take a keyed EVP context for k, making one only if every context made
+   so far is in use by another thread */
+static EVP_CIPHER_CTX *key_ctx_get(ccm_key_t *k)
+{
+     EVP_CIPHER_CTX *ctx = NULL;
+
+     pthread_mutex_lock(&k->lock);
+     if (k->nspare)
+	  ctx = k->spare[--k->nspare];
+     pthread_mutex_unlock(&k->lock);
+     if (ctx)
+	  return ctx;
+
+     ctx = EVP_CIPHER_CTX_new();
+     if (!ctx || !EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, k->key, NULL))
+	  fatal("Error initializing EVP cipher context.");
+     EVP_CIPHER_CTX_set_padding(ctx, 0);
+     return ctx;
+}
+
+static void key_ctx_put(ccm_key_t *k, EVP_CIPHER_CTX *ctx)
+{
+     pthread_mutex_lock(&k->lock);
+     if (k->nspare == k->cap) {
+	  k->cap = k->cap ? 2 * k->cap : 4;
+	  k->spare = realloc(k->spare, k->cap * sizeof(EVP_CIPHER_CTX *));
+	  if (!k->spare)
+	       fatal("Error allocating memory for cipher contexts.");
+     }
+     k->spare[k->nspare++] = ctx;
+     pthread_mutex_unlock(&k->lock);
+}
+
+static void *keystream_range(void *arg)
+{
+     keystream_job_t *job = arg;
+     EVP_CIPHER_CTX *ctx;
+     unsigned long i, n;
+     int len;
+
+     if (job->evp) {
+	  ctx = key_ctx_get(job->key);
+	  for (i=0; i < job->num_ctr; i += n) {
+	       n = job->num_ctr - i;
+	       if (n > EVP_MAX_BLOCKS)
+		    n = EVP_MAX_BLOCKS;
+	       if (!EVP_EncryptUpdate(ctx, job->s + 16*i, &len, job->ctr + 16*i, 16*n))
+		    fatal("Error generating keystream.");
+	  }
+	  key_ctx_put(job->key, ctx);
+     }
+     else
+	  for (i=0; i < job->num_ctr; i++)
+	       AES_encrypt(job->ctr + 16*i, job->s + 16*i, &job->key->schedule);
+     return NULL;
+}
+
+static void *pool_worker(void *arg)
+{
+     keystream_job_t *job;
+
+     for (;;) {
+	  pthread_mutex_lock(&pool.lock);
+	  while (!pool.queue)
+	       pthread_cond_wait(&pool.work, &pool.lock);
+	  job = pool.queue;
+	  pool.queue = job->next;
+	  pthread_mutex_unlock(&pool.lock);
+
+	  keystream_range(job);
+
+	  pthread_mutex_lock(&pool.lock);
+	  if (!--*job->pending)
+	       pthread_cond_broadcast(&pool.done);
+	  pthread_mutex_unlock(&pool.lock);
+     }
+     return NULL;
+}
+
+/* Make sure there are enough pool workers for threads-way keystream
+   generation (the caller is one of the threads).  Called by ccm_init with
+   the profile's thread count; workers are never stopped. */
+void keystream_pool(int threads)
+{
+     pthread_attr_t attr;
+     pthread_t thread;
+
+     pthread_attr_init(&attr);
+     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+     pthread_mutex_lock(&pool.lock);
+     while (pool.workers < threads - 1) {
+	  if (pthread_create(&thread, &attr, pool_worker, NULL))
+	       fatal("Error creating keystream thread.");
+	  __atomic_store_n(&pool.workers, pool.workers + 1, __ATOMIC_RELAXED);
+     }
+     pthread_mutex_unlock(&pool.lock);
+     pthread_attr_destroy(&attr);
+}
+
+/* Encrypt num_ctr contiguous counter blocks into s using the configured
+   backend (EVP only for at least ccm_config.evp_min_blocks blocks).  The
+   blocks are independent, so large runs are split across up to
+   ccm_config.threads threads of the pool, never giving a thread less than
+   ccm_config.chunk blocks. */
+void keystream(unsigned char *s, unsigned char *ctr, unsigned long num_ctr, ccm_key_t *key)
+{
+     int nthreads = ccm_config.threads;
+     int workers = __atomic_load_n(&pool.workers, __ATOMIC_RELAXED);
+     int i, pending;
+     unsigned long per, start;
+
+     if (num_ctr / ccm_config.chunk < nthreads)
+	  nthreads = num_ctr / ccm_config.chunk;
+     if (nthreads > workers + 1)
+	  nthreads = workers + 1;
+     if (nthreads < 1)
+	  nthreads = 1;
+
+     keystream_job_t jobs[nthreads];
+
+     per = num_ctr / nthreads;
+     start = 0;
+     for (i=0; i < nthreads; i++) {
+	  jobs[i].s = s + 16*start;
+	  jobs[i].ctr = ctr + 16*start;
+	  jobs[i].key = key;
+	  jobs[i].evp = ccm_config.backend == BACKEND_EVP && num_ctr >= ccm_config.evp_min_blocks;
+	  jobs[i].num_ctr = (i == nthreads-1) ? num_ctr - start : per;
+	  jobs[i].pending = &pending;
+	  start += per;
+     }
+
+     /* queue all but the last range, which the calling thread takes */
+     pending = nthreads - 1;
+     if (pending) {
+	  pthread_mutex_lock(&pool.lock);
+	  for (i=0; i < nthreads-1; i++) {
+	       jobs[i].next = pool.queue;
+	       pool.queue = &jobs[i];
+	  }
+	  pthread_cond_broadcast(&pool.work);
+	  pthread_mutex_unlock(&pool.lock);
+     }
+     keystream_range(&jobs[nthreads-1]);
+     if (pending) {
+	  pthread_mutex_lock(&pool.lock);
+	  while (pending)
+	       pthread_cond_wait(&pool.done, &pool.lock);
+	  pthread_mutex_unlock(&pool.lock);
+     }
+}
+
 unsigned char* ccm_decrypt(int *p_len, ccm_decrypt_t *input)
 {
      unsigned char *adata = input -> adata;
@@ -343,23 +506,26 @@ unsigned char* ccm_decrypt(int *p_len, ccm_decrypt_t *input)
      unsigned char *key = input -> key;
      unsigned char *p;
      int extrabytes = 0;
-     AES_KEY aes_key;
+     ccm_key_t key_buf, *prepared = input -> prepared;
+     arena_t *scratch = arena_thread(); //reset before returning
+
+     ccm_init(NULL);
+     if (input -> arena == scratch)
+	  fatal("The thread's scratch arena can't hold the plaintext.");
 
      long i;
      if (c_len <= t_len)
 	  return NULL;
+     TRACE(TRACE_START, TRACE_DECRYPT, c_len, a_len);
 
      unsigned long num_ctr = (c_len - t_len + 15) / 16 + 1;
  
-     /* allocate counter blocks */
-     ctr = calloc(num_ctr, sizeof(char*));
-     if (!ctr)
-	  fatal("Error allocating memory for input blocks.");
-     for (i=0; i < num_ctr; i++) {
-	  ctr[i] = calloc(16, sizeof(char));
-	  if (!ctr[i])
-	       fatal("Error allocating memory for input blocks.");
-     }
+     /* allocate counter blocks, contiguous so the keystream can be
+	generated in bulk */
+     ctr = arena_alloc(scratch, num_ctr * sizeof(char*));
+     ctr[0] = arena_alloc(scratch, 16 * num_ctr);
+     for (i=1; i < num_ctr; i++)
+	  ctr[i] = ctr[0] + 16*i;
 
      /* set 3 q-bits of flag */
      unsigned int q = 15 - n_len;
@@ -368,28 +534,28 @@ unsigned char* ccm_decrypt(int *p_len, ccm_decrypt_t *input)
      /* generate CTR blocks */
      gen_ctr(ctr, num_ctr, nonce, n_len, flags);
 
-     if (AES_set_encrypt_key(key, 128, &aes_key))
-	  fatal("Error initializing AES key.");
+     /* prepare the key for this message unless the caller passed one */
+     if (!prepared) {
+	  ccm_key_init(&key_buf, key, NULL);
+	  prepared = &key_buf;
+     }
 
 /* --calculate S blocks -- */
 
      unsigned char **s;
-     s = calloc(num_ctr, sizeof(char*));
-     if (!s)
-	  fatal("Error allocating memory for S blocks.");
-     for (i=0; i < num_ctr; i++) {
-	  s[i] = malloc(16);
-	  if (!s[i])
-	       fatal("Error allocating memory for S blocks.");
-     }
-     
-     for (i=0; i < num_ctr; i++)
-	  AES_encrypt(ctr[i], s[i], &aes_key);
+     s = arena_alloc(scratch, num_ctr * sizeof(char*));
+     s[0] = arena_alloc(scratch, 16 * num_ctr);
+     for (i=1; i < num_ctr; i++)
+	  s[i] = s[0] + 16*i;
+
+     keystream(s[0], ctr[0], num_ctr, prepared);
+     TRACE(TRACE_STAGE, TRACE_DECRYPT, STAGE_KEYSTREAM, 0);
 
      *p_len = c_len - t_len;
 
-     p = malloc(*p_len);
-     if (!p)
+     if (input -> arena)
+	  p = arena_alloc(input -> arena, *p_len);
+     else if (!(p = malloc(*p_len)))
 	  fatal("Error allocating memory for payload.");
 
      /* decrypt (XOR) 64 bits at a time when possible */
@@ -408,6 +574,7 @@ unsigned char* ccm_decrypt(int *p_len, ccm_decrypt_t *input)
      unsigned char tag[t_len];
      for (i=0; i < t_len; i++)
 	  *(tag+i) = (c[(*p_len)+i]) ^ *(s[0]+i);
+     TRACE(TRACE_STAGE, TRACE_DECRYPT, STAGE_XOR, 0);
 
      flags = 0;
      /* set a_len bit of flag (1 if there's any a_data, 0 otherwise)*/
@@ -433,15 +600,11 @@ unsigned char* ccm_decrypt(int *p_len, ccm_decrypt_t *input)
      }
      unsigned long num_blocks = ((a_len + extrabytes + 15) / 16) + num_ctr;
 
-     /* allocate input blocks */
-     blocks = calloc(num_blocks, sizeof(char*));
-     if (!blocks)
-	  fatal("Error allocating memory for input blocks.");
-     for (i=0; i < num_blocks; i++) {
-	  blocks[i] = calloc(16, sizeof(char));
-	  if (!blocks[i])
-	       fatal("Error allocating memory for input blocks.");
-     }
+     /* allocate input blocks; format writes every byte of them */
+     blocks = arena_alloc(scratch, num_blocks * sizeof(char*));
+     blocks[0] = arena_alloc(scratch, 16 * num_blocks);
+     for (i=1; i < num_blocks; i++)
+	  blocks[i] = blocks[0] + 16*i;
 
      /* load data for format function */
      ccm_t format_data;
@@ -454,23 +617,22 @@ unsigned char* ccm_decrypt(int *p_len, ccm_decrypt_t *input)
 
      /* Format Blocks */
      format(&format_data, blocks, num_blocks, flags);
+     TRACE(TRACE_STAGE, TRACE_DECRYPT, STAGE_FORMAT, 0);
 
 /* --calculate new tag for verification-- */
      unsigned char *y0, *y1, *ybuff, *ytemp;
-     y0 = calloc(16, sizeof(char));
-     y1 = calloc(16, sizeof(char));
-     ybuff = calloc(16, sizeof(char));
-     if (!y0 || !y1 || !ybuff)
-	  fatal("Error allocating memory for Y buffer.");
+     y0 = arena_alloc(scratch, 16);
+     y1 = arena_alloc(scratch, 16);
+     ybuff = arena_alloc(scratch, 16);
 
-     AES_encrypt(blocks[0], y0, &aes_key);
+     AES_encrypt(blocks[0], y0, &prepared->schedule);
 
      /* XOR each block with the previous encrypted input block, and encrypt
 	This is done in two 64-bit segments for efficiency */
      for (i=1; i<num_blocks; i++) {
 	  *((uint64_t *) ybuff) = *((uint64_t*) blocks[i]) ^ *((uint64_t*) y0);
 	  *((uint64_t *) (ybuff+8)) = *((uint64_t*) (blocks[i]+8)) ^ *((uint64_t*) (y0+8));
-	  AES_encrypt(ybuff, y1, &aes_key);
+	  AES_encrypt(ybuff, y1, &prepared->schedule);
 
 	  /* swap buffers for next round, don't lose references */
 	  ytemp = y0;
@@ -482,62 +644,22 @@ unsigned char* ccm_decrypt(int *p_len, ccm_decrypt_t *input)
      unsigned char new_tag[t_len];
      memcpy(new_tag, y0, t_len);
 
-     /* compare tags */
-     if (memcmp(tag, new_tag, t_len))
-	  return NULL;
+     TRACE(TRACE_STAGE, TRACE_DECRYPT, STAGE_MAC, 0);
 
-#ifdef DEBUG
-     printf("\n");
-     printf("C:\t");
-     for (i=0; i < c_len; i++) {
-	  printf("%02x", c[i]);
-	  if (!((i+1) % 4))
-	       printf(" ");
-     }
-     printf("\n");
-     printf("\n");
-     for (i=0; i < num_ctr; i++) {
-	  printf("C%lu:\t", i);
-	  print_block(ctr[i]);
-     }
-     printf("\n");
-     for (i=0; i < num_ctr; i++) {
-	  printf("S%lu:\t", i);
-	  print_block(s[i]);
+     /* compare tags, discarding the unverified plaintext on mismatch */
+     if (memcmp(tag, new_tag, t_len)) {
+	  TRACE(TRACE_AUTH_FAIL, TRACE_DECRYPT, 0, 0);
+	  memset(p, 0, *p_len);
+	  if (!input -> arena)
+	       free(p);
+	  p = NULL;
      }
-     printf("\n");
-     printf("P:\t");
-     for (i=0; i < *p_len; i++) {
-	  printf("%02x", p[i]);
-	  if (!((i+1) % 4))
-	       printf(" ");
-     }
-     printf("\n");
-     printf("T:\t");
-     for (i=0; i < t_len; i++) {
-	  printf("%02x", tag[i]);
-	  if (!((i+1) % 4))
-	       printf(" ");
-     }
-     printf("\n");
 
-     printf("\n");
-     for (i=0; i < num_blocks; i++) {
-	  printf("B%lu:\t", i);
-	  print_block(blocks[i]);
-     }
-#endif
-
-/* free memory */
-     for (i=0; i < num_blocks; i++) 
-	  free (blocks[i]);
-     free (blocks);
-     for (i=0; i < num_ctr; i++)
-	  free (ctr[i]);
-     free (ctr);
-     for (i=0; i < num_ctr; i++)
-	  free (s[i]);
-     free (s);
-    
+/* release scratch memory */
+     arena_reset(scratch);
+     if (prepared == &key_buf)
+	  ccm_key_cleanup(&key_buf);
+
+     TRACE(TRACE_END, TRACE_DECRYPT, p ? *p_len : 0, 0);
      return p;
 }
@@ -1,13 +1,50 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+
+/* bump allocator for message buffers (see arena.c) */
+#define ARENA_CHUNK (2UL << 20) //default chunk size, one huge page
+
+typedef struct arena arena_t;
+
+arena_t *arena_new(size_t);
+void *arena_alloc(arena_t *, size_t);
+void arena_reset(arena_t *);
+void arena_free(arena_t *);
+arena_t *arena_thread(void); //ccm's own scratch: never pass as input->arena
+
+/* a key prepared once for any number of messages: the schedule for the
+   CBC-MAC and the AES backend, and keyed EVP contexts (made on first use,
+   then reused) for the EVP backend */
+typedef struct {
+     unsigned char key[16];
+     AES_KEY schedule;
+     pthread_mutex_t lock;
+     EVP_CIPHER_CTX **spare; //keyed contexts not in use
+     int nspare, cap;
+     int refs; //handles held on a keycache entry
+} ccm_key_t;
+
+void ccm_key_init(ccm_key_t *, unsigned char *, AES_KEY *);
+void ccm_key_cleanup(ccm_key_t *);
+
 typedef struct {
      unsigned char *key, *adata, *payload, *nonce;
      unsigned long a_len, n_len, p_len;
      int t_len;
+     ccm_key_t *prepared; //prepared key (e.g. from keycache_get) used instead of key, or NULL
+     arena_t *arena; //allocate the ciphertext here instead of with malloc, or NULL
+     unsigned char *out; //write the p_len + t_len byte ciphertext here instead, or NULL
 } ccm_t;
 
 typedef struct {
      unsigned char *key, *adata, *ciphertext, *nonce;
      unsigned long a_len, n_len, c_len;
      int t_len;
+     ccm_key_t *prepared; //prepared key (e.g. from keycache_get) used instead of key, or NULL
+     arena_t *arena; //allocate the plaintext here instead of with malloc, or NULL
 } ccm_decrypt_t;
 
 unsigned char* ccm_encrypt(int*, ccm_t*);
@@ -15,6 +52,112 @@ unsigned char* ccm_decrypt(int*, ccm_decrypt_t*);
 void print_block(unsigned char*);
 void format(ccm_t*, unsigned char **, unsigned long, unsigned char flags);
 void gen_ctr(unsigned char **, int, unsigned char *, unsigned long, unsigned char);
+void keystream(unsigned char *, unsigned char *, unsigned long, ccm_key_t *);
+void keystream_pool(int);
+
+/* runtime configuration, loaded from a profile written by ccm --tune */
+#define BACKEND_AES 0 //OpenSSL AES_encrypt, one block per call
+#define BACKEND_EVP 1 //OpenSSL EVP in ECB mode, bulk (AES-NI where available)
+
+#define DEFAULT_PROFILE "ccm.profile"
+#define TUNE_SECONDS 3.0
+
+typedef struct {
+     int backend;
+     int threads; //threads used for keystream generation
+     unsigned long chunk; //minimum counter blocks per keystream thread
+     unsigned long evp_min_blocks; //shorter keystreams use AES even with BACKEND_EVP
+} ccm_config_t;
+
+extern ccm_config_t ccm_config;
+
+void ccm_init(char *); //loads the profile once; NULL means $CCM_PROFILE or DEFAULT_PROFILE
+int load_profile(char *);
+void save_profile(char *);
+void tune(char *, double);
+
+/* key schedule cache (see keycache.c) */
+typedef struct keycache keycache_t;
+
+keycache_t *keycache_new(unsigned long);
+void keycache_free(keycache_t *);
+ccm_key_t *keycache_get(keycache_t *, uint64_t, unsigned char *);
+void keycache_release(ccm_key_t *);
+void keycache_put_batch(keycache_t *, int, uint64_t *, unsigned char **);
+void keycache_evict(keycache_t *, uint64_t);
+void keycache_stats(keycache_t *, unsigned long *, unsigned long *, unsigned long *);
+void aes_expand_batch(int, unsigned char **, AES_KEY *);
+
+/* encrypted record log (see reclog.c) */
+typedef struct reclog reclog_t;
+typedef struct reclog_reader reclog_reader_t;
+
+typedef struct {
+     uint64_t seq;
+     unsigned char *hdr, *body; //hdr points into the log, body is valid until the next read
+     size_t hdr_len, body_len;
+     size_t offset; //of the record's frame in the file
+} reclog_record_t;
+
+typedef struct {
+     uint64_t seq;
+     size_t offset;
+} reclog_index_t;
+
+reclog_t *reclog_open(char *, unsigned char *, int);
+int reclog_append(reclog_t *, void *, size_t, void *, size_t, uint64_t *);
+void reclog_sync(reclog_t *, uint64_t);
+unsigned long reclog_commits(reclog_t *);
+void reclog_close(reclog_t *);
+reclog_reader_t *reclog_reader_open(char *, unsigned char *);
+void reclog_reader_close(reclog_reader_t *);
+int reclog_next(reclog_reader_t *, reclog_record_t *);
+long reclog_index(reclog_reader_t *, unsigned long);
+int reclog_seek(reclog_reader_t *, uint64_t);
+long reclog_scan(reclog_reader_t *, int, void (*)(reclog_record_t *, void *), void *);
+
+/* tracing (see trace.c) */
+#define TRACE_MAGIC "CCMTRACE"
+#define TRACE_VERSION 3
+
+#define TRACE_START 0 //arg0 = payload/ciphertext length, arg1 = adata length
+#define TRACE_STAGE 1 //arg0 = stage just finished
+#define TRACE_END 2 //arg0 = output length
+#define TRACE_AUTH_FAIL 3
+
+#define TRACE_ENCRYPT 0
+#define TRACE_DECRYPT 1
+
+#define STAGE_FORMAT 0
+#define STAGE_MAC 1
+#define STAGE_KEYSTREAM 2
+#define STAGE_XOR 3
+
+typedef struct {
+     uint64_t ts; //CLOCK_MONOTONIC, ns
+     uint32_t tid;
+     uint16_t threads; //profiles allow up to 256
+     uint8_t type;
+     uint8_t op : 4, backend : 4;
+     uint64_t arg0, arg1;
+} trace_event_t; //32 bytes
+
+typedef struct {
+     char magic[8];
+     uint32_t version, pid;
+} trace_dump_header_t;
+
+extern volatile int trace_enabled;
+
+#define TRACE(type, op, arg0, arg1)					\
+     do {								\
+	  if (trace_enabled)						\
+	       trace_event(type, op, arg0, arg1);			\
+     } while (0)
+
+void trace_init(void);
+void trace_event(int, int, uint64_t, uint64_t);
+void trace_dump(void);
 
 /* error handling */
 void error(char*); //prints an error messages to stderr, continues
@@ -0,0 +1,412 @@
+/* Authors: Berck Nash, Elijah Ricca
+   Class: Applied Cryptography, Spring 2012
+   file: keycache.c
+
+   Cache of prepared keys (ccm_key_t: the AES schedule plus keyed EVP
+   contexts) indexed by a caller-chosen key ID, so that per-tenant keys
+   are not re-expanded or re-keyed on every message.
+
+   The cache is split into shards, each with its own lock, hash table and
+   LRU list, so concurrent lookups of different keys rarely contend.  The
+   capacity is divided exactly between the shards (small caches use fewer
+   shards so that a few colliding keys don't evict each other), so it is a
+   hard bound, but eviction is least recently used
+   within a shard rather than across the whole cache.  Entries are
+   preallocated and a hit allocates nothing.
+
+   keycache_get hands out a reference to the prepared key, which the
+   caller gives back with keycache_release.  A key evicted or replaced
+   while referenced stays valid until its last reference is released,
+   and is then wiped with OPENSSL_cleanse and freed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <openssl/aes.h>
+#include <openssl/crypto.h>
+#include "ccm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AESNI 1
+#endif
+
+#define KEYCACHE_SHARDS 64
+#define KEYCACHE_MIN_SHARD 8 //entries per shard before another shard is used
+#define EXPAND_WIDTH 4 //keys expanded side by side by aes_expand_batch
+
+typedef struct keycache_entry {
+     uint64_t id;
+     ccm_key_t *key; //holds one reference
+     struct keycache_entry *hnext; //hash chain
+     struct keycache_entry *prev, *next; //LRU list, most recent first
+} keycache_entry_t;
+
+typedef struct {
+     pthread_mutex_t lock;
+     keycache_entry_t **table;
+     unsigned long mask, capacity;
+     keycache_entry_t *entries, *free;
+     keycache_entry_t lru; //sentinel
+     unsigned long hits, misses, evictions;
+} keycache_shard_t;
+
+struct keycache {
+     int nshards;
+     keycache_shard_t shards[KEYCACHE_SHARDS];
+};
+
+/* splitmix64 finalizer: low bits pick the shard, high bits the bucket */
+static uint64_t mix(uint64_t x)
+{
+     x ^= x >> 30;
+     x *= 0xbf58476d1ce4e5b9ULL;
+     x ^= x >> 27;
+     x *= 0x94d049bb133111ebULL;
+     x ^= x >> 31;
+     return x;
+}
+
+keycache_t *keycache_new(unsigned long capacity)
+{
+     keycache_t *cache;
+     keycache_shard_t *shard;
+     unsigned long per, size;
+     int i, j;
+
+     cache = calloc(1, sizeof(keycache_t));
+     if (!cache)
+	  fatal("Error allocating memory for key cache.");
+
+     if (capacity < 1)
+	  capacity = 1;
+     cache->nshards = capacity / KEYCACHE_MIN_SHARD;
+     if (cache->nshards < 1)
+	  cache->nshards = 1;
+     if (cache->nshards > KEYCACHE_SHARDS)
+	  cache->nshards = KEYCACHE_SHARDS;
+
+     for (i=0; i < cache->nshards; i++) {
+	  per = capacity / cache->nshards + (i < capacity % cache->nshards);
+	  for (size = 1; size < 2*per; size <<= 1)
+	       ;
+	  shard = &cache->shards[i];
+	  pthread_mutex_init(&shard->lock, NULL);
+	  shard->table = calloc(size, sizeof(keycache_entry_t *));
+	  shard->entries = calloc(per, sizeof(keycache_entry_t));
+	  if (!shard->table || !shard->entries)
+	       fatal("Error allocating memory for key cache.");
+	  shard->mask = size - 1;
+	  shard->capacity = per;
+	  for (j=0; j < per; j++) {
+	       shard->entries[j].next = shard->free;
+	       shard->free = &shard->entries[j];
+	  }
+	  shard->lru.next = shard->lru.prev = &shard->lru;
+     }
+     return cache;
+}
+
+void keycache_free(keycache_t *cache)
+{
+     keycache_shard_t *shard;
+     unsigned long j;
+     int i;
+
+     if (!cache)
+	  return;
+     for (i=0; i < cache->nshards; i++) {
+	  shard = &cache->shards[i];
+	  for (j=0; j < shard->capacity; j++)
+	       if (shard->entries[j].key)
+		    keycache_release(shard->entries[j].key);
+	  free(shard->entries);
+	  free(shard->table);
+	  pthread_mutex_destroy(&shard->lock);
+     }
+     free(cache);
+}
+
+static keycache_shard_t *shard_for(keycache_t *cache, uint64_t h)
+{
+     return &cache->shards[h % cache->nshards];
+}
+
+static keycache_entry_t **bucket_for(keycache_shard_t *shard, uint64_t h)
+{
+     return &shard->table[(h >> 32) & shard->mask];
+}
+
+static void lru_unlink(keycache_entry_t *e)
+{
+     e->prev->next = e->next;
+     e->next->prev = e->prev;
+}
+
+static void lru_push(keycache_shard_t *shard, keycache_entry_t *e)
+{
+     e->next = shard->lru.next;
+     e->prev = &shard->lru;
+     shard->lru.next->prev = e;
+     shard->lru.next = e;
+}
+
+static ccm_key_t *key_new(unsigned char *key, AES_KEY *schedule)
+{
+     ccm_key_t *k;
+
+     k = malloc(sizeof(ccm_key_t));
+     if (!k)
+	  fatal("Error allocating memory for cached key.");
+     ccm_key_init(k, key, schedule);
+     k->refs = 1;
+     return k;
+}
+
+void keycache_release(ccm_key_t *k)
+{
+     if (__atomic_sub_fetch(&k->refs, 1, __ATOMIC_ACQ_REL))
+	  return;
+     ccm_key_cleanup(k);
+     free(k);
+}
+
+/* unlink e from its hash chain, drop its key and return it to the free
+   list */
+static void entry_drop(keycache_shard_t *shard, keycache_entry_t *e)
+{
+     keycache_entry_t **p = bucket_for(shard, mix(e->id));
+
+     while (*p != e)
+	  p = &(*p)->hnext;
+     *p = e->hnext;
+     lru_unlink(e);
+     keycache_release(e->key);
+     memset(e, 0, sizeof(keycache_entry_t));
+     e->next = shard->free;
+     shard->free = e;
+}
+
+static keycache_entry_t *entry_find(keycache_shard_t *shard, uint64_t id, uint64_t h)
+{
+     keycache_entry_t *e;
+     for (e = *bucket_for(shard, h); e; e = e->hnext)
+	  if (e->id == id)
+	       return e;
+     return NULL;
+}
+
+/* caller holds the shard lock; the entry takes over the caller's
+   reference to key */
+static void entry_insert(keycache_shard_t *shard, uint64_t id, uint64_t h, ccm_key_t *key)
+{
+     keycache_entry_t *e, **bucket;
+
+     e = entry_find(shard, id, h);
+     if (e)
+	  entry_drop(shard, e);
+     if (!shard->free) {
+	  entry_drop(shard, shard->lru.prev);
+	  shard->evictions++;
+     }
+     e = shard->free;
+     shard->free = e->next;
+
+     e->id = id;
+     e->key = key;
+     bucket = bucket_for(shard, h);
+     e->hnext = *bucket;
+     *bucket = e;
+     lru_push(shard, e);
+}
+
+/* Return a reference to the prepared key for id, to be given back with
+   keycache_release.  If key is given it is checked against the cached
+   key, and a miss or mismatch prepares and caches it.  Returns NULL on a
+   miss with no key to prepare. */
+ccm_key_t *keycache_get(keycache_t *cache, uint64_t id, unsigned char *key)
+{
+     uint64_t h = mix(id);
+     keycache_shard_t *shard = shard_for(cache, h);
+     keycache_entry_t *e;
+     ccm_key_t *k;
+
+     pthread_mutex_lock(&shard->lock);
+     e = entry_find(shard, id, h);
+     if (e && (!key || !CRYPTO_memcmp(e->key->key, key, 16))) {
+	  lru_unlink(e);
+	  lru_push(shard, e);
+	  k = e->key;
+	  __atomic_add_fetch(&k->refs, 1, __ATOMIC_RELAXED);
+	  shard->hits++;
+	  pthread_mutex_unlock(&shard->lock);
+	  return k;
+     }
+     shard->misses++;
+     pthread_mutex_unlock(&shard->lock);
+
+     if (!key)
+	  return NULL;
+
+     /* expand outside the lock; a racing insert of the same id is replaced */
+     k = key_new(key, NULL);
+     k->refs = 2; //the cache's and the caller's
+     pthread_mutex_lock(&shard->lock);
+     entry_insert(shard, id, h, k);
+     pthread_mutex_unlock(&shard->lock);
+     return k;
+}
+
+/* Expand and cache n keys at once, e.g. to warm the cache for a batch of
+   tenants. */
+void keycache_put_batch(keycache_t *cache, int n, uint64_t *ids, unsigned char **keys)
+{
+     AES_KEY schedules[EXPAND_WIDTH * 16];
+     keycache_shard_t *shard;
+     uint64_t h;
+     int i, j, m;
+
+     for (i=0; i < n; i += m) {
+	  m = n - i;
+	  if (m > EXPAND_WIDTH * 16)
+	       m = EXPAND_WIDTH * 16;
+	  aes_expand_batch(m, keys + i, schedules);
+	  for (j=0; j < m; j++) {
+	       h = mix(ids[i+j]);
+	       shard = shard_for(cache, h);
+	       pthread_mutex_lock(&shard->lock);
+	       entry_insert(shard, ids[i+j], h, key_new(keys[i+j], &schedules[j]));
+	       pthread_mutex_unlock(&shard->lock);
+	  }
+     }
+     OPENSSL_cleanse(schedules, sizeof(schedules));
+}
+
+void keycache_evict(keycache_t *cache, uint64_t id)
+{
+     uint64_t h = mix(id);
+     keycache_shard_t *shard = shard_for(cache, h);
+     keycache_entry_t *e;
+
+     pthread_mutex_lock(&shard->lock);
+     e = entry_find(shard, id, h);
+     if (e)
+	  entry_drop(shard, e);
+     pthread_mutex_unlock(&shard->lock);
+}
+
+void keycache_stats(keycache_t *cache, unsigned long *hits, unsigned long *misses, unsigned long *evictions)
+{
+     keycache_shard_t *shard;
+     int i;
+
+     *hits = *misses = *evictions = 0;
+     for (i=0; i < cache->nshards; i++) {
+	  shard = &cache->shards[i];
+	  pthread_mutex_lock(&shard->lock);
+	  *hits += shard->hits;
+	  *misses += shard->misses;
+	  *evictions += shard->evictions;
+	  pthread_mutex_unlock(&shard->lock);
+     }
+}
+
+#ifdef HAVE_AESNI
+/* AES-128 key expansion with AES-NI, EXPAND_WIDTH keys interleaved so the
+   aeskeygenassist latency of one key is hidden behind the others.  The
+   round keys come out in AES-NI byte order; swap selects the byte-swapped
+   32-bit word order some OpenSSL builds use for AES_KEY. */
+
+#define EXPAND_ROUND(r, rcon)						\
+     for (j=0; j < EXPAND_WIDTH; j++) {					\
+	  t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k[j], rcon), 0xff); \
+	  k[j] = _mm_xor_si128(k[j], _mm_slli_si128(k[j], 4));		\
+	  k[j] = _mm_xor_si128(k[j], _mm_slli_si128(k[j], 4));		\
+	  k[j] = _mm_xor_si128(k[j], _mm_slli_si128(k[j], 4));		\
+	  k[j] = _mm_xor_si128(k[j], t);				\
+	  _mm_storeu_si128((__m128i *) (out[j].rd_key + 4*r),		\
+			   swap ? _mm_shuffle_epi8(k[j], bswap) : k[j]); \
+     }
+
+__attribute__((target("aes,ssse3")))
+static void aesni_expand(unsigned char **keys, AES_KEY *out, int swap)
+{
+     __m128i k[EXPAND_WIDTH], t;
+     __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+     int j;
+
+     for (j=0; j < EXPAND_WIDTH; j++) {
+	  k[j] = _mm_loadu_si128((__m128i *) keys[j]);
+	  _mm_storeu_si128((__m128i *) out[j].rd_key,
+			   swap ? _mm_shuffle_epi8(k[j], bswap) : k[j]);
+	  out[j].rounds = 10;
+     }
+     EXPAND_ROUND(1, 0x01);
+     EXPAND_ROUND(2, 0x02);
+     EXPAND_ROUND(3, 0x04);
+     EXPAND_ROUND(4, 0x08);
+     EXPAND_ROUND(5, 0x10);
+     EXPAND_ROUND(6, 0x20);
+     EXPAND_ROUND(7, 0x40);
+     EXPAND_ROUND(8, 0x80);
+     EXPAND_ROUND(9, 0x1b);
+     EXPAND_ROUND(10, 0x36);
+}
+#endif
+
+#define LAYOUT_NONE 0 //no SIMD path, use AES_set_encrypt_key
+#define LAYOUT_NATIVE 1
+#define LAYOUT_SWAPPED 2
+
+static pthread_once_t layout_once = PTHREAD_ONCE_INIT;
+static int layout = LAYOUT_NONE;
+
+/* AES_KEY layout depends on how OpenSSL was built, so check which (if
+   either) order the SIMD expansion must produce against a probe key */
+static void layout_detect(void)
+{
+#ifdef HAVE_AESNI
+     unsigned char probe[EXPAND_WIDTH][16], *keys[EXPAND_WIDTH];
+     AES_KEY want, got[EXPAND_WIDTH];
+     size_t len = 11 * 4 * sizeof(want.rd_key[0]);
+     int i, j;
+
+     if (!__builtin_cpu_supports("aes") || !__builtin_cpu_supports("ssse3"))
+	  return;
+     for (i=0; i < EXPAND_WIDTH; i++) {
+	  for (j=0; j < 16; j++)
+	       probe[i][j] = 17*i + 31*j + 1;
+	  keys[i] = probe[i];
+     }
+     AES_set_encrypt_key(probe[EXPAND_WIDTH-1], 128, &want);
+
+     aesni_expand(keys, got, 0);
+     if (!memcmp(want.rd_key, got[EXPAND_WIDTH-1].rd_key, len) && want.rounds == 10) {
+	  layout = LAYOUT_NATIVE;
+	  return;
+     }
+     aesni_expand(keys, got, 1);
+     if (!memcmp(want.rd_key, got[EXPAND_WIDTH-1].rd_key, len) && want.rounds == 10)
+	  layout = LAYOUT_SWAPPED;
+#endif
+}
+
+/* Expand n AES-128 keys into out, EXPAND_WIDTH at a time with AES-NI when
+   the CPU and OpenSSL's AES_KEY layout allow it. */
+void aes_expand_batch(int n, unsigned char **keys, AES_KEY *out)
+{
+     int i = 0;
+
+     pthread_once(&layout_once, layout_detect);
+#ifdef HAVE_AESNI
+     if (layout != LAYOUT_NONE)
+	  for (; i + EXPAND_WIDTH <= n; i += EXPAND_WIDTH)
+	       aesni_expand(keys + i, out + i, layout == LAYOUT_SWAPPED);
+#endif
+     for (; i < n; i++)
+	  if (AES_set_encrypt_key(keys[i], 128, &out[i]))
+	       fatal("Error initializing AES key.");
+}
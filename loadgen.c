@@ -0,0 +1,677 @@
+/* Authors: Berck Nash, Elijah Ricca
+   Class: Applied Cryptography, Spring 2012
+   file: loadgen.c
+
+   ccm-loadgen: open-loop load generator reporting per-message latency
+   distributions, allocator activity and auth-failure injection outcomes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include "ccm.h"
+
+#define PRINT_USAGE {							\
+	  printf("ccm-loadgen usage:\n");				\
+	  printf("%s --threads|-j THREADS\n",argv[0]);			\
+	  printf("--rate|-r MESSAGES_PER_SECOND (0 = unthrottled)\n");	\
+	  printf("--duration|-d SECONDS\n");				\
+	  printf("--payload|-p SIZE_DIST\n");				\
+	  printf("--adata|-a SIZE_DIST\n");				\
+	  printf("--t_len|-t MAC_LENGTH\n");				\
+	  printf("--corrupt|-c FRACTION\n");				\
+	  printf("--seed|-s SEED\n");					\
+	  printf("--tenants|-k NUMBER_OF_KEYS\n");			\
+	  printf("--key-cache|-K CAPACITY (0 = expand every message)\n"); \
+	  printf("--arena|-A (allocate outputs from a per-thread arena)\n"); \
+	  printf("--output|-o REPORT_FILE\n");				\
+	  printf("SIZE_DIST is fixed:N, bimodal:SMALL,LARGE,P_LARGE or trace:FILE\n"); \
+     }									\
+
+#define NONCE_LEN 11 //leaves 4 bytes for the payload length
+
+/* log-linear (HDR-style) histogram: 128 linear sub-buckets per power of two,
+   so any recorded value is reported within 1% */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+     uint64_t counts[HIST_SIZE];
+     uint64_t total, max;
+} hist_t;
+
+#define DIST_FIXED 0
+#define DIST_BIMODAL 1
+#define DIST_TRACE 2
+
+typedef struct {
+     int type;
+     unsigned long small, large;
+     double p_large;
+     unsigned long *trace;
+     unsigned long trace_len;
+     char *spec;
+} dist_t;
+
+typedef struct {
+     int id;
+     pthread_t thread;
+     uint64_t rng;
+     hist_t encrypt, decrypt, message;
+     unsigned long messages, bytes;
+     unsigned long injected, detected, missed, false_failures;
+} worker_t;
+
+static dist_t payload_dist, adata_dist;
+static int t_len = 8;
+static int nthreads = 1;
+static double rate = 0;
+static double duration = 5;
+static double corrupt = 0;
+static unsigned long tenants = 1;
+static unsigned char *tenant_keys;
+static keycache_t *key_cache;
+static int use_arena = 0;
+static uint64_t start_ns, end_ns;
+static pthread_barrier_t phase; //workers and main, around the measured run
+
+/* Allocator counters for the whole process.  The malloc family below
+   replaces glibc's for every library loaded into ccm-loadgen, so calls from
+   libcrypto and from the keystream pool are seen too; libcrypto is also
+   pointed at the same counters with CRYPTO_set_mem_functions. */
+static unsigned long alloc_calls, alloc_bytes, frees;
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void *__libc_memalign(size_t, size_t);
+void __libc_free(void *);
+
+static void count_alloc(size_t size)
+{
+     __atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+     __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+static void count_free(void *ptr)
+{
+     if (ptr)
+	  __atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+     count_alloc(size);
+     return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+     count_alloc(n * size);
+     return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+     count_alloc(size);
+     count_free(ptr); //the old block, whether or not it moves
+     return __libc_realloc(ptr, size);
+}
+
+void *reallocarray(void *ptr, size_t n, size_t size)
+{
+     if (size && n > SIZE_MAX / size) {
+	  errno = ENOMEM;
+	  return NULL;
+     }
+     return realloc(ptr, n * size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+     count_alloc(size);
+     return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+     return memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+     void *p = memalign(align, size);
+     if (!p)
+	  return ENOMEM;
+     *ptr = p;
+     return 0;
+}
+
+void free(void *ptr)
+{
+     count_free(ptr);
+     __libc_free(ptr);
+}
+
+static void *crypto_malloc(size_t size, const char *file, int line)
+{
+     count_alloc(size);
+     return __libc_malloc(size);
+}
+
+static void *crypto_realloc(void *ptr, size_t size, const char *file, int line)
+{
+     count_alloc(size);
+     count_free(ptr); //the old block, whether or not it moves
+     return __libc_realloc(ptr, size);
+}
+
+static void crypto_free(void *ptr, const char *file, int line)
+{
+     count_free(ptr);
+     __libc_free(ptr);
+}
+
+static uint64_t now_ns(void)
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t rng_next(uint64_t *state)
+{
+     *state ^= *state >> 12;
+     *state ^= *state << 25;
+     *state ^= *state >> 27;
+     return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static double rng_double(uint64_t *state)
+{
+     return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int hist_index(uint64_t v)
+{
+     int e;
+     if (v < HIST_SUB)
+	  return v;
+     e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+     return (e+1) * HIST_SUB + (int) ((v >> e) - HIST_SUB);
+}
+
+/* highest value that lands in bucket idx */
+static uint64_t hist_value(int idx)
+{
+     int e;
+     if (idx < HIST_SUB)
+	  return idx;
+     e = idx / HIST_SUB - 1;
+     return ((uint64_t) (idx % HIST_SUB + HIST_SUB + 1) << e) - 1;
+}
+
+static void hist_record(hist_t *h, uint64_t v)
+{
+     h->counts[hist_index(v)]++;
+     h->total++;
+     if (v > h->max)
+	  h->max = v;
+}
+
+static void hist_merge(hist_t *dst, hist_t *src)
+{
+     int i;
+     for (i=0; i < HIST_SIZE; i++)
+	  dst->counts[i] += src->counts[i];
+     dst->total += src->total;
+     if (src->max > dst->max)
+	  dst->max = src->max;
+}
+
+static uint64_t hist_percentile(hist_t *h, double p)
+{
+     uint64_t want, seen = 0;
+     int i;
+
+     if (!h->total)
+	  return 0;
+     want = (uint64_t) (p / 100.0 * h->total + 0.5);
+     if (want < 1)
+	  want = 1;
+     for (i=0; i < HIST_SIZE; i++) {
+	  seen += h->counts[i];
+	  if (seen >= want)
+	       return hist_value(i) < h->max ? hist_value(i) : h->max;
+     }
+     return h->max;
+}
+
+static void parse_dist(dist_t *d, char *spec)
+{
+     FILE *file;
+     unsigned long size, cap = 0;
+
+     memset(d, 0, sizeof(*d));
+     d->spec = spec;
+     if (!strncmp(spec, "fixed:", 6)) {
+	  d->type = DIST_FIXED;
+	  d->small = strtoul(spec+6, NULL, 10);
+     }
+     else if (!strncmp(spec, "bimodal:", 8)) {
+	  d->type = DIST_BIMODAL;
+	  if (sscanf(spec+8, "%lu,%lu,%lf", &d->small, &d->large, &d->p_large) != 3
+	      || d->p_large < 0 || d->p_large > 1)
+	       fatal("Bimodal size distribution must be bimodal:SMALL,LARGE,P_LARGE.");
+     }
+     else if (!strncmp(spec, "trace:", 6)) {
+	  d->type = DIST_TRACE;
+	  file = fopen(spec+6, "r");
+	  if (!file)
+	       fatal("Error opening size trace for reading.");
+	  while (fscanf(file, "%lu", &size) == 1) {
+	       if (d->trace_len == cap) {
+		    cap = cap ? 2*cap : 1024;
+		    d->trace = realloc(d->trace, cap * sizeof(unsigned long));
+		    if (!d->trace)
+			 fatal("Error allocating memory for size trace.");
+	       }
+	       d->trace[d->trace_len++] = size;
+	  }
+	  fclose(file);
+	  if (!d->trace_len)
+	       fatal("Size trace is empty.");
+     }
+     else
+	  fatal("Unknown size distribution, use fixed:, bimodal: or trace:.");
+}
+
+static unsigned long dist_max(dist_t *d)
+{
+     unsigned long i, max = 0;
+     switch (d->type) {
+     case DIST_FIXED:
+	  return d->small;
+     case DIST_BIMODAL:
+	  return d->small > d->large ? d->small : d->large;
+     }
+     for (i=0; i < d->trace_len; i++)
+	  if (d->trace[i] > max)
+	       max = d->trace[i];
+     return max;
+}
+
+/* n is the worker's message sequence number, used to replay traces in order */
+static unsigned long dist_sample(dist_t *d, uint64_t *rng, worker_t *w, unsigned long n)
+{
+     switch (d->type) {
+     case DIST_FIXED:
+	  return d->small;
+     case DIST_BIMODAL:
+	  return rng_double(rng) < d->p_large ? d->large : d->small;
+     }
+     return d->trace[(n * nthreads + w->id) % d->trace_len];
+}
+
+static void *worker(void *arg)
+{
+     worker_t *w = arg;
+     unsigned long max_p = dist_max(&payload_dist);
+     unsigned long max_a = dist_max(&adata_dist);
+     unsigned char *payload, *adata, *key, nonce[NONCE_LEN];
+     unsigned char *c, *p;
+     int c_len, p_len, corrupted;
+     unsigned long i, n, tenant;
+     arena_t *arena = NULL;
+     uint64_t interval, intended, t0, t1, t2;
+     struct timespec ts;
+     ccm_t input;
+     ccm_decrypt_t output;
+
+     payload = malloc(max_p ? max_p : 1);
+     adata = malloc(max_a ? max_a : 1);
+     if (!payload || !adata)
+	  fatal("Error allocating memory for load buffers.");
+     for (i=0; i < max_p; i++)
+	  payload[i] = rng_next(&w->rng);
+     for (i=0; i < max_a; i++)
+	  adata[i] = rng_next(&w->rng);
+
+     memset(nonce, 0, sizeof(nonce));
+     input.nonce = nonce;
+     input.n_len = NONCE_LEN;
+     input.adata = adata;
+     input.payload = payload;
+     input.t_len = t_len;
+     if (use_arena)
+	  arena = arena_new(ARENA_CHUNK);
+     input.arena = arena;
+     input.out = NULL;
+
+     /* each worker sends its share of the total rate on a fixed schedule;
+	latency is measured from the scheduled send time so that stalls are
+	not hidden (no coordinated omission) */
+     interval = rate > 0 ? (uint64_t) (1e9 * nthreads / rate) : 0;
+     intended = start_ns + (interval * w->id) / nthreads;
+
+     /* setup is done; main reads the allocator counters between the waits */
+     pthread_barrier_wait(&phase);
+     pthread_barrier_wait(&phase);
+
+     for (n=0; ; n++) {
+	  if (interval) {
+	       if (intended >= end_ns)
+		    break;
+	       ts.tv_sec = intended / 1000000000;
+	       ts.tv_nsec = intended % 1000000000;
+	       clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	  }
+	  else {
+	       intended = now_ns();
+	       if (intended >= end_ns)
+		    break;
+	  }
+
+	  input.p_len = dist_sample(&payload_dist, &w->rng, w, n);
+	  input.a_len = dist_sample(&adata_dist, &w->rng, w, n);
+	  if (!input.p_len)
+	       input.p_len = 1; //ccm_decrypt rejects empty payloads
+	  memcpy(nonce, &n, sizeof(n) < NONCE_LEN ? sizeof(n) : NONCE_LEN);
+	  nonce[NONCE_LEN-1] = w->id;
+	  tenant = tenants > 1 ? rng_next(&w->rng) % tenants : 0;
+	  key = tenant_keys + 16*tenant;
+
+	  t0 = now_ns();
+	  input.key = key;
+	  input.prepared = key_cache ? keycache_get(key_cache, tenant, key) : NULL;
+	  c = ccm_encrypt(&c_len, &input);
+	  t1 = now_ns();
+
+	  corrupted = corrupt > 0 && rng_double(&w->rng) < corrupt;
+	  if (corrupted)
+	       c[rng_next(&w->rng) % c_len] ^= 1 << (rng_next(&w->rng) % 8);
+
+	  output.key = key;
+	  output.adata = adata;
+	  output.nonce = nonce;
+	  output.a_len = input.a_len;
+	  output.n_len = NONCE_LEN;
+	  output.t_len = t_len;
+	  output.ciphertext = c;
+	  output.c_len = c_len;
+	  output.prepared = input.prepared;
+	  output.arena = arena;
+	  p = ccm_decrypt(&p_len, &output);
+	  t2 = now_ns();
+	  if (input.prepared)
+	       keycache_release(input.prepared);
+
+	  if (corrupted) {
+	       w->injected++;
+	       if (p)
+		    w->missed++;
+	       else
+		    w->detected++;
+	  }
+	  else if (!p)
+	       w->false_failures++;
+	  if (arena)
+	       arena_reset(arena);
+	  else {
+	       free(c);
+	       free(p);
+	  }
+
+	  hist_record(&w->encrypt, t1 - t0);
+	  hist_record(&w->decrypt, t2 - t1);
+	  hist_record(&w->message, t2 - intended);
+	  w->messages++;
+	  w->bytes += input.p_len;
+
+	  intended += interval;
+     }
+
+     pthread_barrier_wait(&phase);
+     pthread_barrier_wait(&phase);
+
+     arena_free(arena);
+     free(payload);
+     free(adata);
+     return NULL;
+}
+
+static void report_hist(FILE *out, char *name, hist_t *h)
+{
+     fprintf(out, "%s.p50_ns %lu\n", name, hist_percentile(h, 50));
+     fprintf(out, "%s.p90_ns %lu\n", name, hist_percentile(h, 90));
+     fprintf(out, "%s.p99_ns %lu\n", name, hist_percentile(h, 99));
+     fprintf(out, "%s.p999_ns %lu\n", name, hist_percentile(h, 99.9));
+     fprintf(out, "%s.max_ns %lu\n", name, h->max);
+}
+
+int main(int argc, char *argv[])
+{
+     char *payload_spec = "fixed:1024";
+     char *adata_spec = "fixed:16";
+     char *output_filename = NULL;
+     uint64_t seed = 1;
+     uint64_t rng, *ids;
+     unsigned char **keys;
+     unsigned long cache_size = 0, cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+     unsigned long warm, j;
+     int opt, option_index;
+     int i;
+     worker_t *workers;
+     hist_t *encrypt, *decrypt, *message;
+     unsigned long messages = 0, bytes = 0;
+     unsigned long calls = 0, alloc = 0, freed = 0;
+     unsigned long injected = 0, detected = 0, missed = 0, false_failures = 0;
+     double elapsed;
+     FILE *out = stdout;
+
+     static struct option long_options[] = {
+	  {"threads",		required_argument,	0, 'j'},
+	  {"rate",		required_argument,	0, 'r'},
+	  {"duration",		required_argument,	0, 'd'},
+	  {"payload",		required_argument,	0, 'p'},
+	  {"adata",		required_argument,	0, 'a'},
+	  {"t_len",		required_argument,	0, 't'},
+	  {"corrupt",		required_argument,	0, 'c'},
+	  {"seed",		required_argument,	0, 's'},
+	  {"tenants",		required_argument,	0, 'k'},
+	  {"key-cache",		required_argument,	0, 'K'},
+	  {"arena",		no_argument,		0, 'A'},
+	  {"output",		required_argument,	0, 'o'},
+	  {"help",		no_argument,		0, 'h'},
+	  {0, 0, 0, 0}
+     };
+
+     /* must come before libcrypto allocates anything */
+     if (!CRYPTO_set_mem_functions(crypto_malloc, crypto_realloc, crypto_free))
+	  error("Cannot count libcrypto allocations.");
+
+     while ((opt = getopt_long (argc, argv, "j:r:d:p:a:t:c:s:k:K:Ao:h?",
+				long_options, &option_index)) != -1 ) {
+	  switch (opt) {
+	  case 'j':
+	       nthreads = strtol(optarg, NULL, 10);
+	       break;
+	  case 'r':
+	       rate = strtod(optarg, NULL);
+	       break;
+	  case 'd':
+	       duration = strtod(optarg, NULL);
+	       break;
+	  case 'p':
+	       payload_spec = optarg;
+	       break;
+	  case 'a':
+	       adata_spec = optarg;
+	       break;
+	  case 't':
+	       t_len = strtol(optarg, NULL, 10);
+	       break;
+	  case 'c':
+	       corrupt = strtod(optarg, NULL);
+	       break;
+	  case 's':
+	       seed = strtoull(optarg, NULL, 10);
+	       break;
+	  case 'k':
+	       tenants = strtoul(optarg, NULL, 10);
+	       break;
+	  case 'K':
+	       cache_size = strtoul(optarg, NULL, 10);
+	       break;
+	  case 'A':
+	       use_arena = 1;
+	       break;
+	  case 'o':
+	       output_filename = optarg;
+	       break;
+	  case 'h': //intentional fall-through
+	  case '?':
+	       PRINT_USAGE;
+	       exit(0);
+	  }
+     }
+
+     if (nthreads < 1 || nthreads > 255)
+	  fatal("Thread count must be between 1 and 255.");
+     if (t_len != 4 && t_len != 6 && t_len != 8 && t_len != 10 && t_len != 12 && t_len != 14 && t_len != 16)
+	  fatal("MAC Length must be either 4,6,8,10,12,14, or 16 bytes long.");
+     if (duration <= 0 || rate < 0 || corrupt < 0 || corrupt > 1)
+	  fatal("Duration must be positive, rate non-negative and corrupt between 0 and 1.");
+     parse_dist(&payload_dist, payload_spec);
+     parse_dist(&adata_dist, adata_spec);
+     if (tenants < 1)
+	  fatal("There must be at least one tenant.");
+
+     /* one random key per tenant */
+     tenant_keys = malloc(16 * tenants);
+     if (!tenant_keys)
+	  fatal("Error allocating memory for tenant keys.");
+     rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+     for (j=0; j < 16 * tenants; j++)
+	  tenant_keys[j] = rng_next(&rng);
+
+     /* warm the cache with a batched expansion of as many keys as fit */
+     if (cache_size) {
+	  key_cache = keycache_new(cache_size);
+	  warm = tenants < cache_size ? tenants : cache_size;
+	  ids = malloc(warm * sizeof(uint64_t));
+	  keys = malloc(warm * sizeof(unsigned char *));
+	  if (!ids || !keys)
+	       fatal("Error allocating memory for key cache warm-up.");
+	  for (j=0; j < warm; j++) {
+	       ids[j] = j;
+	       keys[j] = tenant_keys + 16*j;
+	  }
+	  keycache_put_batch(key_cache, warm, ids, keys);
+	  free(ids);
+	  free(keys);
+     }
+
+     /* load the tuning profile before the clock starts */
+     ccm_init(NULL);
+
+     workers = calloc(nthreads, sizeof(worker_t));
+     encrypt = calloc(3, sizeof(hist_t));
+     if (!workers || !encrypt)
+	  fatal("Error allocating memory for workers.");
+     decrypt = encrypt + 1;
+     message = encrypt + 2;
+
+     if (pthread_barrier_init(&phase, NULL, nthreads + 1))
+	  fatal("Error creating worker barrier.");
+     start_ns = now_ns() + 10000000; //give every worker time to start
+     end_ns = start_ns + (uint64_t) (duration * 1e9);
+     for (i=0; i < nthreads; i++) {
+	  workers[i].id = i;
+	  workers[i].rng = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+	  if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]))
+	       fatal("Error creating worker thread.");
+     }
+
+     /* count only allocations made while the workers run their messages */
+     pthread_barrier_wait(&phase);
+     calls = __atomic_load_n(&alloc_calls, __ATOMIC_RELAXED);
+     alloc = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+     freed = __atomic_load_n(&frees, __ATOMIC_RELAXED);
+     pthread_barrier_wait(&phase);
+     pthread_barrier_wait(&phase);
+     calls = __atomic_load_n(&alloc_calls, __ATOMIC_RELAXED) - calls;
+     alloc = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - alloc;
+     freed = __atomic_load_n(&frees, __ATOMIC_RELAXED) - freed;
+     pthread_barrier_wait(&phase);
+
+     for (i=0; i < nthreads; i++) {
+	  pthread_join(workers[i].thread, NULL);
+	  hist_merge(encrypt, &workers[i].encrypt);
+	  hist_merge(decrypt, &workers[i].decrypt);
+	  hist_merge(message, &workers[i].message);
+	  messages += workers[i].messages;
+	  bytes += workers[i].bytes;
+	  injected += workers[i].injected;
+	  detected += workers[i].detected;
+	  missed += workers[i].missed;
+	  false_failures += workers[i].false_failures;
+     }
+     elapsed = (now_ns() - start_ns) / 1e9;
+     pthread_barrier_destroy(&phase);
+     if (key_cache)
+	  keycache_stats(key_cache, &cache_hits, &cache_misses, &cache_evictions);
+
+     if (output_filename) {
+	  out = fopen(output_filename, "w");
+	  if (!out)
+	       fatal("Error opening report file for writing.");
+     }
+
+     /* one "name value" pair per line so reports from two builds diff cleanly */
+     fprintf(out, "# ccm-loadgen report\n");
+     fprintf(out, "config.threads %d\n", nthreads);
+     fprintf(out, "config.rate %.0f\n", rate);
+     fprintf(out, "config.duration %.1f\n", duration);
+     fprintf(out, "config.payload %s\n", payload_dist.spec);
+     fprintf(out, "config.adata %s\n", adata_dist.spec);
+     fprintf(out, "config.t_len %d\n", t_len);
+     fprintf(out, "config.corrupt %g\n", corrupt);
+     fprintf(out, "config.tenants %lu\n", tenants);
+     fprintf(out, "config.key_cache %lu\n", cache_size);
+     fprintf(out, "config.arena %d\n", use_arena);
+     fprintf(out, "config.backend %s\n", ccm_config.backend == BACKEND_EVP ? "evp" : "aes");
+     fprintf(out, "config.keystream_threads %d\n", ccm_config.threads);
+     fprintf(out, "messages %lu\n", messages);
+     fprintf(out, "achieved_rate %.0f\n", messages / elapsed);
+     fprintf(out, "throughput_mbps %.1f\n", bytes / elapsed / 1e6);
+     report_hist(out, "encrypt", encrypt);
+     report_hist(out, "decrypt", decrypt);
+     report_hist(out, "message", message);
+     fprintf(out, "alloc.calls_per_msg %.2f\n", messages ? (double) calls / messages : 0);
+     fprintf(out, "alloc.bytes_per_msg %.0f\n", messages ? (double) alloc / messages : 0);
+     fprintf(out, "alloc.leaked_per_msg %.2f\n", messages ? (double) (calls - freed) / messages : 0);
+     fprintf(out, "keycache.hits %lu\n", cache_hits);
+     fprintf(out, "keycache.misses %lu\n", cache_misses);
+     fprintf(out, "keycache.evictions %lu\n", cache_evictions);
+     fprintf(out, "auth.injected %lu\n", injected);
+     fprintf(out, "auth.detected %lu\n", detected);
+     fprintf(out, "auth.missed %lu\n", missed);
+     fprintf(out, "auth.false_failures %lu\n", false_failures);
+
+     if (out != stdout)
+	  fclose(out);
+     keycache_free(key_cache);
+     free(tenant_keys);
+     free(workers);
+     free(encrypt);
+     return missed || false_failures;
+}
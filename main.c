@@ -16,6 +16,8 @@
           printf("--key|-k KEY_FILE\n");				\
           printf("--payload|-p PAYLOAD_FILE\n");			\
 	  printf("--t_len|-t MAC_LENGTH\n");				\
+	  printf("--profile|-P TUNING_PROFILE\n");			\
+	  printf("%s --tune [--profile TUNING_PROFILE]\n",argv[0]);	\
      }                                                                  \
 
 int main(int argc,char *argv[]){
@@ -25,11 +27,14 @@ int main(int argc,char *argv[]){
      char *key_filename = NULL;
      char *payload_filename = NULL;
      char *nonce_filename = NULL;
+     char *profile_filename = NULL;
+     int do_tune = 0;
      int opt, option_index;
      int t_len = 8;
 
      ccm_t input;
      uint64_t key_len;
+     arena_t *arena;
 
      /* parse command line options */
      static struct option long_options[] = {
@@ -38,11 +43,14 @@ int main(int argc,char *argv[]){
 	  {"key",		required_argument,	0, 'k'},
 	  {"nonce",		required_argument,	0, 'n'},
 	  {"t_len",		required_argument,	0, 't'},
+	  {"profile",		required_argument,	0, 'P'},
+	  {"tune",		no_argument,		0, 'T'},
           {"help",              no_argument,            0, 'h'},
+	  {0, 0, 0, 0}
 
      };
 
-     while ((opt = getopt_long (argc, argv, "a:p:k:n:t:h?",
+     while ((opt = getopt_long (argc, argv, "a:p:k:n:t:P:Th?",
                                 long_options, &option_index)) != -1 ) {
           switch (opt) {
           case 'a':
@@ -60,6 +68,12 @@ int main(int argc,char *argv[]){
 	  case 't':
 	       t_len = strtol(optarg, NULL, 10);
 	       break;
+	  case 'P':
+	       profile_filename = optarg;
+	       break;
+	  case 'T':
+	       do_tune = 1;
+	       break;
           case 'h': //intentional fall-through
           case '?':
                PRINT_USAGE;
@@ -67,12 +81,29 @@ int main(int argc,char *argv[]){
           }
      }
 
+     /* benchmark this host and write a tuning profile */
+     if (do_tune) {
+	  if (!profile_filename)
+	       profile_filename = getenv("CCM_PROFILE");
+	  if (!profile_filename)
+	       profile_filename = DEFAULT_PROFILE;
+	  tune(profile_filename, TUNE_SECONDS);
+	  exit(0);
+     }
+     ccm_init(profile_filename);
+
+     /* file buffers, ciphertext and decrypted payload all live here */
+     arena = arena_new(ARENA_CHUNK);
+
      /* check t_len size */
      if (t_len != 4 && t_len != 6 && t_len != 8 && t_len != 10 && t_len != 12 && t_len != 14 && t_len != 16)
 	  fatal("MAC Length must be either 4,6,8,10,12,14, or 16 bytes long.");
      if (t_len < 8)
 	  error("Warning: Mac Length less than 64 bits used.  This is not recommended.");
      input.t_len = t_len;
+     input.prepared = NULL;
+     input.arena = arena;
+     input.out = NULL;
 
      /* load associated data */
      adata_file = fopen(adata_filename, "rb");
@@ -85,9 +116,7 @@ int main(int argc,char *argv[]){
      rewind(adata_file);
      
      /* read associated data from file */
-     input.adata = malloc(input.a_len);
-     if (!input.adata)
-	  fatal("Error allocating memory for associated data.");
+     input.adata = arena_alloc(arena, input.a_len);
      fread(input.adata, input.a_len, 1, adata_file);
      fclose(adata_file);
 
@@ -107,9 +136,7 @@ int main(int argc,char *argv[]){
 	  fatal("Key is not 128 bits long.");
 
      /* read key data from file */
-     input.key = malloc(32);
-     if (!input.key)
-	  fatal("Error allocating memory for key data.");
+     input.key = arena_alloc(arena, 32);
      fread(input.key, key_len, 1, key_file);
      fclose(key_file);
 
@@ -125,9 +152,7 @@ int main(int argc,char *argv[]){
      rewind(payload_file);
      
      /* read associated payload from file */
-     input.payload = malloc(input.p_len);
-     if (!input.payload)
-	  fatal("Error allocating memory for payload data.");
+     input.payload = arena_alloc(arena, input.p_len);
      fread(input.payload, input.p_len, 1, payload_file);
      fclose(payload_file);
 
@@ -142,9 +167,7 @@ int main(int argc,char *argv[]){
      rewind(nonce_file);
      
      /* read nonce data from file */
-     input.nonce = malloc(input.n_len);
-     if (!input.nonce)
-	  fatal("Error allocating memory for nonce data.");
+     input.nonce = arena_alloc(arena, input.n_len);
      fread(input.nonce, input.n_len, 1, nonce_file);
      fclose(nonce_file);
 
@@ -167,6 +190,8 @@ int main(int argc,char *argv[]){
      output.t_len = t_len;
      output.ciphertext = ciphertext;
      output.c_len = c_len;
+     output.prepared = NULL;
+     output.arena = arena;
 
      unsigned char *output_payload;
      int output_p_len = 0;
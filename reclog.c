@@ -0,0 +1,619 @@
+/* Authors: Berck Nash, Elijah Ricca
+   Class: Applied Cryptography, Spring 2012
+   file: reclog.c
+
+   Append-only log of CCM-encrypted records.  Each record is its own CCM
+   message: the caller's record header is the associated data and the
+   nonce is the record's sequence number.  Records are encrypted under a
+   per-log subkey, the caller's key applied to the log's random 128-bit id,
+   so sequence numbers can restart in every log without reusing a nonce.
+   The header is bound to every record: the id through the subkey and the
+   tag length through the CCM flags, so editing it makes every record fail.
+
+   Writers on any thread queue records with reclog_append.  A committer
+   thread takes everything queued so far as one group, encrypts it into a
+   single buffer laid out exactly as on disk, writes that with one write
+   and makes it durable with a single fdatasync, then wakes
+   anyone waiting in reclog_sync.  Records queued while a group is being
+   committed form the next group, so commit latency stays bounded by
+   roughly one encrypt+write+sync of the previous group.
+
+   File layout (integers big endian):
+     header  "CCMRLOG2", t_len (1), zero pad to 16, log id (16)
+     frame   length of the rest (4), sequence (8), header length (2),
+             header, ciphertext with tag
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include "ccm.h"
+
+#define RECLOG_MAGIC "CCMRLOG2"
+#define RECLOG_HEADER 32
+#define RECLOG_ID_LEN 16
+#define RECLOG_NONCE_LEN 8 //the sequence number, leaves 7 bytes for the record length
+#define RECLOG_FRAME 14 //length, sequence and header length
+#define RECLOG_MAX_BODY ((1UL << 24) - 1)
+#define RECLOG_MAX_PENDING (4UL << 20) //queued bytes before appenders block, bounds group size
+
+typedef struct {
+     uint64_t seq;
+     unsigned char *hdr, *body;
+     size_t hdr_len, body_len;
+} reclog_pending_t;
+
+typedef struct {
+     arena_t *arena; //record copies and the encoded group
+     reclog_pending_t *recs;
+     unsigned long count, cap;
+     size_t bytes;
+} reclog_batch_t;
+
+struct reclog {
+     int fd, t_len, closing;
+     ccm_key_t key; //per-log subkey, prepared once
+     pthread_t committer;
+     pthread_mutex_t lock;
+     pthread_cond_t work, done, room;
+     reclog_batch_t batches[2], *pending;
+     uint64_t next_seq, durable_seq;
+     unsigned long commits;
+};
+
+struct reclog_reader {
+     unsigned char *map;
+     size_t size, pos, end;
+     int t_len;
+     ccm_key_t *key; //shared with reclog_scan's threads
+     uint64_t next_seq;
+     arena_t *arena; //plaintext of the current record
+     reclog_index_t *index;
+     unsigned long index_len;
+};
+
+static void make_nonce(unsigned char *nonce, uint64_t seq)
+{
+     uint64_t seq_be = htobe64(seq);
+     memcpy(nonce, &seq_be, RECLOG_NONCE_LEN);
+}
+
+static int valid_t_len(int t_len)
+{
+     return t_len >= 4 && t_len <= 16 && !(t_len % 2);
+}
+
+/* prepare subkey = AES(key, id) */
+static void derive_key(unsigned char *key, unsigned char *id, ccm_key_t *subkey)
+{
+     AES_KEY schedule;
+     unsigned char raw[16];
+
+     if (AES_set_encrypt_key(key, 128, &schedule))
+	  fatal("Error initializing AES key.");
+     AES_encrypt(id, raw, &schedule);
+     ccm_key_init(subkey, raw, NULL);
+     OPENSSL_cleanse(&schedule, sizeof(schedule));
+     OPENSSL_cleanse(raw, sizeof(raw));
+}
+
+/* write len bytes, retrying partial writes */
+static void write_all(int fd, unsigned char *buf, size_t len)
+{
+     ssize_t done;
+
+     while (len) {
+	  done = write(fd, buf, len);
+	  if (done < 0)
+	       fatal("Error writing record log.");
+	  buf += done;
+	  len -= done;
+     }
+}
+
+/* encode the group as it goes on disk, frame, header and ciphertext of
+   each record back to back in one buffer, so it takes a single write */
+static void commit_batch(reclog_t *log, reclog_batch_t *batch)
+{
+     reclog_pending_t *rec;
+     unsigned char nonce[RECLOG_NONCE_LEN], *buf, *frame;
+     uint32_t len_be;
+     uint64_t seq_be;
+     uint16_t hdr_len_be;
+     unsigned long i;
+     size_t size = 0;
+     int c_len;
+     ccm_t input;
+
+     for (i=0; i < batch->count; i++)
+	  size += RECLOG_FRAME + batch->recs[i].hdr_len + batch->recs[i].body_len + log->t_len;
+     buf = arena_alloc(batch->arena, size);
+
+     input.key = NULL;
+     input.prepared = &log->key;
+     input.arena = NULL;
+     input.nonce = nonce;
+     input.n_len = RECLOG_NONCE_LEN;
+     input.t_len = log->t_len;
+
+     frame = buf;
+     for (i=0; i < batch->count; i++) {
+	  rec = &batch->recs[i];
+	  make_nonce(nonce, rec->seq);
+	  input.adata = rec->hdr;
+	  input.a_len = rec->hdr_len;
+	  input.payload = rec->body;
+	  input.p_len = rec->body_len;
+	  input.out = frame + RECLOG_FRAME + rec->hdr_len;
+	  ccm_encrypt(&c_len, &input);
+
+	  len_be = htobe32(RECLOG_FRAME - 4 + rec->hdr_len + c_len);
+	  seq_be = htobe64(rec->seq);
+	  hdr_len_be = htobe16(rec->hdr_len);
+	  memcpy(frame, &len_be, 4);
+	  memcpy(frame + 4, &seq_be, 8);
+	  memcpy(frame + 12, &hdr_len_be, 2);
+	  memcpy(frame + RECLOG_FRAME, rec->hdr, rec->hdr_len);
+	  frame += RECLOG_FRAME + rec->hdr_len + c_len;
+     }
+
+     write_all(log->fd, buf, size);
+     if (fdatasync(log->fd))
+	  fatal("Error syncing record log.");
+}
+
+static void *committer(void *arg)
+{
+     reclog_t *log = arg;
+     reclog_batch_t *batch;
+     uint64_t last;
+
+     pthread_mutex_lock(&log->lock);
+     for (;;) {
+	  while (!log->pending->count && !log->closing)
+	       pthread_cond_wait(&log->work, &log->lock);
+	  if (!log->pending->count)
+	       break;
+
+	  /* take the whole queue as one group; appenders fill the other batch */
+	  batch = log->pending;
+	  log->pending = batch == &log->batches[0] ? &log->batches[1] : &log->batches[0];
+	  last = batch->recs[batch->count - 1].seq;
+	  pthread_cond_broadcast(&log->room);
+	  pthread_mutex_unlock(&log->lock);
+
+	  commit_batch(log, batch);
+	  batch->count = 0;
+	  batch->bytes = 0;
+	  arena_reset(batch->arena);
+
+	  pthread_mutex_lock(&log->lock);
+	  log->durable_seq = last + 1;
+	  log->commits++;
+	  pthread_cond_broadcast(&log->done);
+     }
+     pthread_mutex_unlock(&log->lock);
+     return NULL;
+}
+
+/* make the directory entry for a newly created filename durable */
+static void sync_dir(char *filename)
+{
+     char *copy;
+     int fd;
+
+     if (!(copy = strdup(filename)))
+	  fatal("Error allocating memory for record log name.");
+     fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+     if (fd < 0)
+	  fatal("Error opening record log directory.");
+     if (fsync(fd))
+	  fatal("Error syncing record log directory.");
+     close(fd);
+     free(copy);
+}
+
+/* Create filename as a new log encrypted under the 16-byte key with
+   t_len-byte tags.  An existing file is never overwritten. */
+reclog_t *reclog_open(char *filename, unsigned char *key, int t_len)
+{
+     reclog_t *log;
+     unsigned char header[RECLOG_HEADER];
+     int i;
+
+     if (!valid_t_len(t_len))
+	  fatal("MAC Length must be either 4,6,8,10,12,14, or 16 bytes long.");
+     log = calloc(1, sizeof(reclog_t));
+     if (!log)
+	  fatal("Error allocating memory for record log.");
+     log->t_len = t_len;
+     memset(header, 0, sizeof(header));
+     memcpy(header, RECLOG_MAGIC, 8);
+     header[8] = t_len;
+     if (RAND_bytes(header + 16, RECLOG_ID_LEN) != 1)
+	  fatal("Error generating record log id.");
+     derive_key(key, header + 16, &log->key);
+
+     log->fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+     if (log->fd < 0)
+	  fatal("Error creating record log.");
+     if (write(log->fd, header, sizeof(header)) != sizeof(header))
+	  fatal("Error writing record log header.");
+     if (fdatasync(log->fd))
+	  fatal("Error syncing record log.");
+     sync_dir(filename);
+
+     for (i=0; i < 2; i++)
+	  log->batches[i].arena = arena_new(ARENA_CHUNK);
+     log->pending = &log->batches[0];
+     pthread_mutex_init(&log->lock, NULL);
+     pthread_cond_init(&log->work, NULL);
+     pthread_cond_init(&log->done, NULL);
+     pthread_cond_init(&log->room, NULL);
+     if (pthread_create(&log->committer, NULL, committer, log))
+	  fatal("Error creating record log committer thread.");
+     return log;
+}
+
+/* Queue a record; hdr is stored in the clear but authenticated, body is
+   encrypted.  The sequence number is stored in *seq if seq is not NULL.
+   Returns 0, or -1 if the record is empty or too large. */
+int reclog_append(reclog_t *log, void *hdr, size_t hdr_len, void *body, size_t body_len, uint64_t *seq)
+{
+     reclog_batch_t *batch;
+     reclog_pending_t *rec;
+
+     if (!body_len || body_len > RECLOG_MAX_BODY || hdr_len > 0xffff)
+	  return -1;
+
+     pthread_mutex_lock(&log->lock);
+     while (log->pending->bytes > RECLOG_MAX_PENDING)
+	  pthread_cond_wait(&log->room, &log->lock);
+
+     batch = log->pending;
+     if (batch->count == batch->cap) {
+	  batch->cap = batch->cap ? 2 * batch->cap : 1024;
+	  batch->recs = realloc(batch->recs, batch->cap * sizeof(reclog_pending_t));
+	  if (!batch->recs)
+	       fatal("Error allocating memory for record queue.");
+     }
+     rec = &batch->recs[batch->count++];
+     rec->seq = log->next_seq++;
+     rec->hdr = arena_alloc(batch->arena, hdr_len);
+     rec->body = arena_alloc(batch->arena, body_len);
+     rec->hdr_len = hdr_len;
+     rec->body_len = body_len;
+     memcpy(rec->hdr, hdr, hdr_len);
+     memcpy(rec->body, body, body_len);
+     batch->bytes += hdr_len + body_len;
+     if (seq)
+	  *seq = rec->seq;
+
+     if (batch->count == 1)
+	  pthread_cond_signal(&log->work);
+     pthread_mutex_unlock(&log->lock);
+     return 0;
+}
+
+/* wait until record seq (and everything before it) is on stable storage */
+void reclog_sync(reclog_t *log, uint64_t seq)
+{
+     pthread_mutex_lock(&log->lock);
+     while (log->durable_seq <= seq)
+	  pthread_cond_wait(&log->done, &log->lock);
+     pthread_mutex_unlock(&log->lock);
+}
+
+/* number of group commits so far */
+unsigned long reclog_commits(reclog_t *log)
+{
+     unsigned long commits;
+     pthread_mutex_lock(&log->lock);
+     commits = log->commits;
+     pthread_mutex_unlock(&log->lock);
+     return commits;
+}
+
+/* commit everything queued, then close the file and wipe the key */
+void reclog_close(reclog_t *log)
+{
+     int i;
+
+     pthread_mutex_lock(&log->lock);
+     log->closing = 1;
+     pthread_cond_signal(&log->work);
+     pthread_mutex_unlock(&log->lock);
+     pthread_join(log->committer, NULL);
+
+     if (close(log->fd))
+	  fatal("Error closing record log.");
+     for (i=0; i < 2; i++) {
+	  arena_free(log->batches[i].arena);
+	  free(log->batches[i].recs);
+     }
+     pthread_mutex_destroy(&log->lock);
+     pthread_cond_destroy(&log->work);
+     pthread_cond_destroy(&log->done);
+     pthread_cond_destroy(&log->room);
+     ccm_key_cleanup(&log->key);
+     OPENSSL_cleanse(log, sizeof(reclog_t));
+     free(log);
+}
+
+reclog_reader_t *reclog_reader_open(char *filename, unsigned char *key)
+{
+     reclog_reader_t *reader;
+     struct stat st;
+     static const unsigned char pad[7];
+     int fd;
+
+     reader = calloc(1, sizeof(reclog_reader_t));
+     if (!reader)
+	  fatal("Error allocating memory for record log reader.");
+
+     fd = open(filename, O_RDONLY);
+     if (fd < 0)
+	  fatal("Error opening record log for reading.");
+     if (fstat(fd, &st))
+	  fatal("Error reading record log size.");
+     reader->size = st.st_size;
+     if (reader->size < RECLOG_HEADER)
+	  fatal("Record log is too short.");
+     reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+     if (reader->map == MAP_FAILED)
+	  fatal("Error mapping record log.");
+     close(fd);
+     madvise(reader->map, reader->size, MADV_SEQUENTIAL);
+
+     if (memcmp(reader->map, RECLOG_MAGIC, 8))
+	  fatal("Not a record log.");
+     reader->t_len = reader->map[8];
+     if (!valid_t_len(reader->t_len) || memcmp(reader->map + 9, pad, sizeof(pad)))
+	  fatal("Corrupt record log header.");
+     reader->key = malloc(sizeof(ccm_key_t));
+     if (!reader->key)
+	  fatal("Error allocating memory for record log key.");
+     derive_key(key, reader->map + 16, reader->key);
+
+     reader->pos = RECLOG_HEADER;
+     reader->end = reader->size;
+     reader->arena = arena_new(ARENA_CHUNK);
+     return reader;
+}
+
+void reclog_reader_close(reclog_reader_t *reader)
+{
+     munmap(reader->map, reader->size);
+     arena_free(reader->arena);
+     free(reader->index);
+     ccm_key_cleanup(reader->key);
+     free(reader->key);
+     OPENSSL_cleanse(reader, sizeof(reclog_reader_t));
+     free(reader);
+}
+
+/* Parse the frame at pos without decrypting it.  Returns the frame's
+   total size, or 0 if it is truncated or malformed. */
+static size_t frame_parse(reclog_reader_t *reader, size_t pos, uint64_t *seq, size_t *hdr_len)
+{
+     uint32_t len_be;
+     uint64_t seq_be;
+     uint16_t hdr_len_be;
+     size_t len;
+
+     if (reader->end - pos < RECLOG_FRAME)
+	  return 0;
+     memcpy(&len_be, reader->map + pos, 4);
+     memcpy(&seq_be, reader->map + pos + 4, 8);
+     memcpy(&hdr_len_be, reader->map + pos + 12, 2);
+     len = be32toh(len_be) + 4;
+     *seq = be64toh(seq_be);
+     *hdr_len = be16toh(hdr_len_be);
+     if (len > reader->end - pos || len <= RECLOG_FRAME + *hdr_len + reader->t_len)
+	  return 0;
+     return len;
+}
+
+/* Verify and decrypt the next record into rec; rec->body stays valid until
+   the next call.  Returns 1 for a record, 0 at the end of the log and -1
+   if the record is truncated, out of sequence or fails authentication. */
+int reclog_next(reclog_reader_t *reader, reclog_record_t *rec)
+{
+     unsigned char nonce[RECLOG_NONCE_LEN];
+     size_t len, hdr_len;
+     uint64_t seq;
+     int p_len;
+     ccm_decrypt_t input;
+
+     if (reader->pos == reader->end)
+	  return 0;
+     len = frame_parse(reader, reader->pos, &seq, &hdr_len);
+     if (!len || seq != reader->next_seq)
+	  return -1;
+
+     arena_reset(reader->arena);
+     make_nonce(nonce, seq);
+     input.key = NULL;
+     input.prepared = reader->key;
+     input.arena = reader->arena;
+     input.nonce = nonce;
+     input.n_len = RECLOG_NONCE_LEN;
+     input.t_len = reader->t_len;
+     input.adata = reader->map + reader->pos + RECLOG_FRAME;
+     input.a_len = hdr_len;
+     input.ciphertext = input.adata + hdr_len;
+     input.c_len = len - RECLOG_FRAME - hdr_len;
+
+     rec->body = ccm_decrypt(&p_len, &input);
+     if (!rec->body)
+	  return -1;
+     rec->seq = seq;
+     rec->hdr = input.adata;
+     rec->hdr_len = hdr_len;
+     rec->body_len = p_len;
+     rec->offset = reader->pos;
+
+     reader->pos += len;
+     reader->next_seq++;
+     return 1;
+}
+
+/* Walk the frames (without decrypting) and remember the offset of every
+   stride'th record.  Returns the number of records, or -1 if the log is
+   malformed. */
+long reclog_index(reclog_reader_t *reader, unsigned long stride)
+{
+     size_t pos = RECLOG_HEADER, len, hdr_len;
+     uint64_t seq, n = 0;
+     unsigned long cap = 0;
+
+     free(reader->index);
+     reader->index = NULL;
+     reader->index_len = 0;
+     if (stride < 1)
+	  stride = 1;
+
+     while (pos < reader->end) {
+	  len = frame_parse(reader, pos, &seq, &hdr_len);
+	  if (!len || seq != n)
+	       return -1;
+	  if (!(n % stride)) {
+	       if (reader->index_len == cap) {
+		    cap = cap ? 2 * cap : 1024;
+		    reader->index = realloc(reader->index, cap * sizeof(reclog_index_t));
+		    if (!reader->index)
+			 fatal("Error allocating memory for record log index.");
+	       }
+	       reader->index[reader->index_len].seq = seq;
+	       reader->index[reader->index_len++].offset = pos;
+	  }
+	  pos += len;
+	  n++;
+     }
+     return n;
+}
+
+/* Position the reader so the next record returned is seq.  Uses the index
+   if one was built.  Returns 0, or -1 if there is no such record. */
+int reclog_seek(reclog_reader_t *reader, uint64_t seq)
+{
+     size_t len, hdr_len;
+     uint64_t s;
+     unsigned long lo = 0, hi = reader->index_len, mid;
+
+     reader->pos = RECLOG_HEADER;
+     reader->next_seq = 0;
+     if (hi) {
+	  /* last index entry at or before seq */
+	  while (hi - lo > 1) {
+	       mid = (lo + hi) / 2;
+	       if (reader->index[mid].seq <= seq)
+		    lo = mid;
+	       else
+		    hi = mid;
+	  }
+	  reader->pos = reader->index[lo].offset;
+	  reader->next_seq = reader->index[lo].seq;
+     }
+     while (reader->next_seq < seq) {
+	  len = frame_parse(reader, reader->pos, &s, &hdr_len);
+	  if (!len)
+	       return -1;
+	  reader->pos += len;
+	  reader->next_seq++;
+     }
+     return reader->pos < reader->end ? 0 : -1;
+}
+
+typedef struct {
+     pthread_t thread;
+     reclog_reader_t reader;
+     void (*fn)(reclog_record_t *, void *);
+     void *arg;
+     uint64_t start_seq;
+     long count;
+     int failed;
+} scan_job_t;
+
+static void *scan_range(void *arg)
+{
+     scan_job_t *job = arg;
+     reclog_record_t rec;
+     int ret;
+
+     while ((ret = reclog_next(&job->reader, &rec)) > 0) {
+	  if (job->fn)
+	       job->fn(&rec, job->arg);
+	  job->count++;
+     }
+     job->failed = ret < 0;
+     return NULL;
+}
+
+/* Verify every record using nthreads threads, each taking a contiguous
+   range of the sparse index, and call fn (if not NULL) on each record.
+   fn runs concurrently and ranges are not delivered in order.  Uses the
+   reader's index if reclog_index was called, otherwise builds one.
+   Returns the number of records, or -1 if any record fails. */
+long reclog_scan(reclog_reader_t *reader, int nthreads, void (*fn)(reclog_record_t *, void *), void *arg)
+{
+     scan_job_t *jobs;
+     unsigned long first, last;
+     long total = 0;
+     int i, failed = 0;
+
+     if (!reader->index_len && reclog_index(reader, 1024) < 0)
+	  return -1;
+     if (nthreads < 1)
+	  nthreads = 1;
+     if (nthreads > reader->index_len)
+	  nthreads = reader->index_len ? reader->index_len : 1;
+
+     jobs = calloc(nthreads, sizeof(scan_job_t));
+     if (!jobs)
+	  fatal("Error allocating memory for scan threads.");
+     for (i=0; i < nthreads; i++) {
+	  first = reader->index_len * i / nthreads;
+	  last = reader->index_len * (i+1) / nthreads;
+	  jobs[i].reader = *reader;
+	  jobs[i].reader.index = NULL;
+	  jobs[i].reader.index_len = 0;
+	  jobs[i].reader.arena = arena_new(ARENA_CHUNK);
+	  jobs[i].reader.pos = reader->index_len ? reader->index[first].offset : RECLOG_HEADER;
+	  jobs[i].reader.next_seq = reader->index_len ? reader->index[first].seq : 0;
+	  jobs[i].start_seq = jobs[i].reader.next_seq;
+	  jobs[i].reader.end = last < reader->index_len ? reader->index[last].offset : reader->end;
+	  jobs[i].fn = fn;
+	  jobs[i].arg = arg;
+     }
+
+     /* the calling thread takes the last range itself */
+     for (i=0; i < nthreads-1; i++)
+	  if (pthread_create(&jobs[i].thread, NULL, scan_range, &jobs[i]))
+	       fatal("Error creating scan thread.");
+     scan_range(&jobs[nthreads-1]);
+     for (i=0; i < nthreads; i++) {
+	  if (i < nthreads-1)
+	       pthread_join(jobs[i].thread, NULL);
+	  total += jobs[i].count;
+	  failed |= jobs[i].failed;
+	  /* each range must end exactly where the next one starts */
+	  if (i < nthreads-1 && jobs[i].reader.next_seq != jobs[i+1].start_seq)
+	       failed = 1;
+	  arena_free(jobs[i].reader.arena);
+     }
+     OPENSSL_cleanse(jobs, nthreads * sizeof(scan_job_t));
+     free(jobs);
+     return failed ? -1 : total;
+}
@@ -0,0 +1,197 @@
+/* Authors: Berck Nash, Elijah Ricca
+   Class: Applied Cryptography, Spring 2012
+   file: reclogtool.c
+
+   ccm-reclog: writes a record log from several producer threads and
+   reports the sustained rate, or verifies an existing log sequentially or
+   in parallel.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include "ccm.h"
+
+#define PRINT_USAGE {							\
+	  printf("ccm-reclog usage:\n");				\
+	  printf("%s --key|-k KEY_FILE\n",argv[0]);			\
+	  printf("--write|-w LOG_FILE | --read|-r LOG_FILE\n");		\
+	  printf("--records|-n RECORDS (write)\n");			\
+	  printf("--size|-s RECORD_BYTES (write)\n");			\
+	  printf("--threads|-j THREADS\n");				\
+	  printf("--t_len|-t MAC_LENGTH\n");				\
+     }									\
+
+typedef struct {
+     pthread_t thread;
+     int id;
+     reclog_t *log;
+     unsigned long records;
+     size_t size;
+} producer_t;
+
+static double now(void)
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer(void *arg)
+{
+     producer_t *p = arg;
+     unsigned char *body;
+     uint64_t hdr[2]; //producer id, per-producer counter
+     unsigned long i;
+
+     body = malloc(p->size);
+     if (!body)
+	  fatal("Error allocating memory for record body.");
+     memset(body, p->id, p->size);
+     hdr[0] = p->id;
+     for (i=0; i < p->records; i++) {
+	  hdr[1] = i;
+	  if (reclog_append(p->log, hdr, sizeof(hdr), body, p->size, NULL))
+	       fatal("Record rejected by log.");
+     }
+     free(body);
+     return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+     char *key_filename = NULL;
+     char *write_filename = NULL;
+     char *read_filename = NULL;
+     unsigned long records = 1000000;
+     size_t size = 100;
+     int nthreads = 1;
+     int t_len = 8;
+     int opt, option_index;
+     int i;
+     unsigned char key[16];
+     FILE *key_file;
+     double start, elapsed;
+     producer_t *producers;
+     reclog_t *log;
+     reclog_reader_t *reader;
+     reclog_record_t rec;
+     long count;
+     int ret;
+
+     static struct option long_options[] = {
+	  {"key",		required_argument,	0, 'k'},
+	  {"write",		required_argument,	0, 'w'},
+	  {"read",		required_argument,	0, 'r'},
+	  {"records",		required_argument,	0, 'n'},
+	  {"size",		required_argument,	0, 's'},
+	  {"threads",		required_argument,	0, 'j'},
+	  {"t_len",		required_argument,	0, 't'},
+	  {"help",		no_argument,		0, 'h'},
+	  {0, 0, 0, 0}
+     };
+
+     while ((opt = getopt_long (argc, argv, "k:w:r:n:s:j:t:h?",
+				long_options, &option_index)) != -1 ) {
+	  switch (opt) {
+	  case 'k':
+	       key_filename = optarg;
+	       break;
+	  case 'w':
+	       write_filename = optarg;
+	       break;
+	  case 'r':
+	       read_filename = optarg;
+	       break;
+	  case 'n':
+	       records = strtoul(optarg, NULL, 10);
+	       break;
+	  case 's':
+	       size = strtoul(optarg, NULL, 10);
+	       break;
+	  case 'j':
+	       nthreads = strtol(optarg, NULL, 10);
+	       break;
+	  case 't':
+	       t_len = strtol(optarg, NULL, 10);
+	       break;
+	  case 'h': //intentional fall-through
+	  case '?':
+	       PRINT_USAGE;
+	       exit(0);
+	  }
+     }
+
+     if (!key_filename || !write_filename == !read_filename) {
+	  PRINT_USAGE;
+	  exit(1);
+     }
+     if (nthreads < 1)
+	  fatal("Thread count must be at least 1.");
+     if (t_len != 4 && t_len != 6 && t_len != 8 && t_len != 10 && t_len != 12 && t_len != 14 && t_len != 16)
+	  fatal("MAC Length must be either 4,6,8,10,12,14, or 16 bytes long.");
+
+     key_file = fopen(key_filename, "rb");
+     if (!key_file)
+	  fatal("Error opening key file for reading.");
+     if (fread(key, 1, sizeof(key), key_file) != sizeof(key) || fgetc(key_file) != EOF)
+	  fatal("Key is not 128 bits long.");
+     fclose(key_file);
+
+     if (write_filename) {
+	  producers = calloc(nthreads, sizeof(producer_t));
+	  if (!producers)
+	       fatal("Error allocating memory for producers.");
+	  log = reclog_open(write_filename, key, t_len);
+
+	  start = now();
+	  for (i=0; i < nthreads; i++) {
+	       producers[i].id = i;
+	       producers[i].log = log;
+	       producers[i].size = size;
+	       producers[i].records = records / nthreads + (i < records % nthreads);
+	       if (pthread_create(&producers[i].thread, NULL, producer, &producers[i]))
+		    fatal("Error creating producer thread.");
+	  }
+	  for (i=0; i < nthreads; i++)
+	       pthread_join(producers[i].thread, NULL);
+	  if (records)
+	       reclog_sync(log, records - 1);
+	  count = reclog_commits(log);
+	  reclog_close(log);
+	  elapsed = now() - start;
+
+	  printf("wrote %lu records in %.3f s: %.0f records/s, %.1f MB/s, %ld group commits\n",
+		 records, elapsed, records / elapsed, records * size / elapsed / 1e6, count);
+	  free(producers);
+     }
+     else {
+	  reader = reclog_reader_open(read_filename, key);
+	  start = now();
+	  if (nthreads > 1)
+	       count = reclog_scan(reader, nthreads, NULL, NULL);
+	  else {
+	       count = 0;
+	       while ((ret = reclog_next(reader, &rec)) > 0)
+		    count++;
+	       if (ret < 0) {
+		    fprintf(stderr, "record %ld failed verification\n", count);
+		    count = -1;
+	       }
+	  }
+	  elapsed = now() - start;
+	  reclog_reader_close(reader);
+
+	  if (count < 0) {
+	       printf("Verification failed.\n");
+	       return 1;
+	  }
+	  printf("verified %ld records in %.3f s: %.0f records/s\n",
+		 count, elapsed, count / elapsed);
+     }
+     return 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/sh
+# key schedule cache: more tenants than the cache holds, under both backends;
+# every corrupted message must be caught and no good one rejected
+for backend in aes evp; do
+     profile=$(mktemp)
+     printf 'backend %s\n' $backend > $profile
+     CCM_PROFILE=$profile ./ccm-loadgen -j 2 -r 0 -d 1 -k 500 -K 64 -c 0.01 -p bimodal:64,65536,0.1 > test5.out
+     rm -f $profile
+     grep -q '^auth.false_failures 0$' test5.out && grep -q '^auth.missed 0$' test5.out &&
+	  ! grep -q '^keycache.evictions 0$' test5.out || { cat test5.out; rm -f test5.out; echo "keycache $backend: FAILED"; exit 1; }
+     echo "keycache $backend: ok"
+done
+rm -f test5.out
@@ -0,0 +1,46 @@
+#!/bin/sh
+# record log: round trip under both backends, then tampering, truncation, a
+# wrong key and overwriting an existing log must all be refused
+log=test6.log
+verify() { ./ccm-reclog -k key.1 -r $log "$@" > /dev/null 2>&1; }
+check() { if [ $1 -eq 0 ]; then echo "reclog $2: ok"; else echo "reclog $2: FAILED"; rm -f $log $log.bad; exit 1; fi; }
+# overwrite bytes at offset $1 with octal escapes $2
+poke() { cp $log $log.bad; printf "$2" | dd of=$log.bad bs=1 seek=$1 conv=notrunc 2> /dev/null; }
+
+rm -f $log
+for backend in aes evp; do
+     profile=$(mktemp)
+     printf 'backend %s\nthreads 2\nchunk 16\n' $backend > $profile
+     rm -f $log
+     CCM_PROFILE=$profile ./ccm-reclog -k key.1 -w $log -n 2000 -s 100 -j 4 > /dev/null &&
+	  CCM_PROFILE=$profile verify && CCM_PROFILE=$profile verify -j 3
+     check $? "round trip $backend"
+     rm -f $profile
+done
+
+./ccm-reclog -k key.1 -w $log -n 1 > /dev/null 2>&1
+check $((! $?)) "refuses to overwrite"
+
+for t in 0 4 16; do
+     poke 8 "\\$(printf %03o $t)"
+     ./ccm-reclog -k key.1 -r $log.bad > /dev/null 2>&1
+     check $((! $?)) "tag length $t in header"
+done
+
+poke 20 '\001'
+./ccm-reclog -k key.1 -r $log.bad > /dev/null 2>&1
+check $((! $?)) "log id in header"
+
+poke 5000 '\377'
+./ccm-reclog -k key.1 -r $log.bad > /dev/null 2>&1
+check $((! $?)) "record data"
+
+head -c 100000 $log > $log.bad
+./ccm-reclog -k key.1 -r $log.bad -j 2 > /dev/null 2>&1
+check $((! $?)) "truncation"
+
+printf 'not the right key' | head -c 16 > $log.key
+./ccm-reclog -k $log.key -r $log > /dev/null 2>&1
+check $((! $?)) "wrong key"
+
+rm -f $log $log.bad $log.key
@@ -0,0 +1,23 @@
+#!/bin/sh
+# tracing: record a short load run with some corrupted messages, then decode
+# the dump as text and as Chrome JSON and look for every kind of event
+trace=test7.trace
+fail() { echo "trace $1: FAILED"; rm -f $trace; exit 1; }
+
+rm -f $trace
+CCM_TRACE=1 CCM_TRACE_FILE=$trace ./ccm-loadgen -j 2 -r 2000 -d 0.5 -c 0.05 > /dev/null || fail "record"
+./ccm-trace $trace > $trace.txt || fail "decode"
+for event in 'encrypt	start' 'decrypt	start' 'keystream done' 'mac done' 'end	len' 'AUTH FAILURE'; do
+     grep -q "$event" $trace.txt || { rm -f $trace.txt; fail "text '$event'"; }
+done
+rm -f $trace.txt
+echo "trace text: ok"
+
+./ccm-trace --chrome $trace > $trace.json || fail "decode"
+for event in '"name":"encrypt"' '"name":"decrypt"' '"name":"keystream"' '"name":"auth failure"'; do
+     grep -q "$event" $trace.json || { rm -f $trace.json; fail "chrome '$event'"; }
+done
+python3 -c 'import json,sys; json.load(open(sys.argv[1]))' $trace.json 2> /dev/null || [ $? -eq 127 ] || { rm -f $trace.json; fail "chrome json"; }
+rm -f $trace.json
+echo "trace chrome: ok"
+rm -f $trace
@@ -0,0 +1,215 @@
+/* Authors: Berck Nash, Elijah Ricca
+   Class: Applied Cryptography, Spring 2012
+   file: trace.c
+
+   Per-thread binary trace rings.  Each thread that encrypts or decrypts
+   while tracing is on gets its own ring, so recording an event is a few
+   stores and no locks.  Rings are only read when dumping.
+
+   Controlled by environment variables read at library init:
+     CCM_TRACE         unset: tracing off, no signal handlers installed
+                       0: handlers installed, recording starts off
+                       1: recording starts on
+     CCM_TRACE_EVENTS  events per thread ring (rounded up to a power of two)
+     CCM_TRACE_FILE    dump file, default ccm.trace.PID
+
+   SIGUSR1 toggles recording, SIGUSR2 dumps every ring.  Rings are also
+   dumped at exit if anything was recorded.  Decode with ccm-trace.
+
+   A thread's ring is released when the thread exits and handed to the
+   next thread that starts tracing, so memory is bounded by the number of
+   threads tracing at once.  Events already in a released ring stay there
+   for the next dump until they are overwritten.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "ccm.h"
+
+#define TRACE_DEFAULT_EVENTS 65536
+#define TRACE_MAX_EVENTS (1UL << 24) //512 MB per ring
+
+typedef struct trace_ring {
+     struct trace_ring *next;
+     uint64_t head; //total events ever written
+     uint64_t mask;
+     uint32_t tid; //thread currently writing the ring
+     int idle; //owner has exited, ring may be claimed
+     trace_event_t *events;
+} trace_ring_t;
+
+volatile int trace_enabled = 0;
+
+static trace_ring_t *rings; //every ring ever created, pushed lock-free
+static __thread trace_ring_t *ring;
+static uint64_t ring_size = TRACE_DEFAULT_EVENTS;
+static char dump_filename[256];
+static int recorded = 0;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static void ring_release(void *r)
+{
+     __atomic_store_n(&((trace_ring_t *) r)->idle, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void)
+{
+     if (pthread_key_create(&ring_key, ring_release))
+	  fatal("Error creating trace ring key.");
+}
+
+/* claim a ring left behind by an exited thread, or make a new one */
+static trace_ring_t *ring_get(void)
+{
+     trace_ring_t *r;
+     int idle;
+
+     for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+	  idle = 1;
+	  if (__atomic_compare_exchange_n(&r->idle, &idle, 0, 0,
+					  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	       return r;
+     }
+
+     r = calloc(1, sizeof(trace_ring_t));
+     if (!r)
+	  return NULL;
+     r->events = calloc(ring_size, sizeof(trace_event_t));
+     if (!r->events) {
+	  free(r);
+	  return NULL;
+     }
+     r->mask = ring_size - 1;
+
+     /* rings are never unlinked, so a dump can walk the list without locks */
+     r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+     while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	  ;
+     return r;
+}
+
+void trace_event(int type, int op, uint64_t arg0, uint64_t arg1)
+{
+     trace_event_t *ev;
+     struct timespec ts;
+     uint64_t head;
+
+     if (!ring) {
+	  pthread_once(&ring_once, ring_key_create);
+	  ring = ring_get();
+	  if (!ring) {
+	       trace_enabled = 0;
+	       return;
+	  }
+	  ring->tid = syscall(SYS_gettid);
+	  pthread_setspecific(ring_key, ring);
+     }
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     head = ring->head;
+     ev = &ring->events[head & ring->mask];
+     ev->ts = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+     ev->tid = ring->tid;
+     ev->type = type;
+     ev->op = op;
+     ev->backend = ccm_config.backend;
+     ev->threads = ccm_config.threads;
+     ev->arg0 = arg0;
+     ev->arg1 = arg1;
+     __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+     recorded = 1;
+}
+
+/* Write every ring to the dump file.  Only uses async-signal-safe calls so
+   it can run from the SIGUSR2 handler.  Events being overwritten while the
+   dump runs may come out torn; the decoder tolerates that. */
+void trace_dump(void)
+{
+     trace_dump_header_t header;
+     trace_ring_t *r;
+     uint64_t head, first, i, n;
+     int fd;
+
+     fd = open(dump_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+     if (fd < 0)
+	  return;
+
+     memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+     header.version = TRACE_VERSION;
+     header.pid = getpid();
+     if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+	  close(fd);
+	  return;
+     }
+
+     for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+	  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	  first = head > r->mask + 1 ? head - (r->mask + 1) : 0;
+	  /* oldest events first; the ring may wrap once */
+	  for (i = first; i < head; i += n) {
+	       n = (r->mask + 1) - (i & r->mask);
+	       if (n > head - i)
+		    n = head - i;
+	       if (write(fd, &r->events[i & r->mask], n * sizeof(trace_event_t)) < 0)
+		    break;
+	  }
+     }
+     close(fd);
+}
+
+static void trace_signal(int sig)
+{
+     if (sig == SIGUSR1)
+	  trace_enabled = !trace_enabled;
+     else
+	  trace_dump();
+}
+
+static void trace_exit(void)
+{
+     if (recorded)
+	  trace_dump();
+}
+
+void trace_init(void)
+{
+     char *env;
+     unsigned long n;
+     struct sigaction sa;
+
+     env = getenv("CCM_TRACE");
+     if (!env)
+	  return;
+
+     if (getenv("CCM_TRACE_EVENTS")) {
+	  n = strtoul(getenv("CCM_TRACE_EVENTS"), NULL, 10);
+	  if (n > TRACE_MAX_EVENTS)
+	       n = TRACE_MAX_EVENTS;
+	  for (ring_size = 1; ring_size < n; ring_size <<= 1)
+	       ;
+     }
+     if (getenv("CCM_TRACE_FILE"))
+	  snprintf(dump_filename, sizeof(dump_filename), "%s", getenv("CCM_TRACE_FILE"));
+     else
+	  snprintf(dump_filename, sizeof(dump_filename), "ccm.trace.%d", (int) getpid());
+
+     memset(&sa, 0, sizeof(sa));
+     sa.sa_handler = trace_signal;
+     sa.sa_flags = SA_RESTART;
+     sigemptyset(&sa.sa_mask);
+     if (sigaction(SIGUSR1, &sa, NULL) || sigaction(SIGUSR2, &sa, NULL))
+	  error("Error installing trace signal handlers.");
+     atexit(trace_exit);
+
+     trace_enabled = strtol(env, NULL, 10) != 0;
+}
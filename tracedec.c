@@ -0,0 +1,190 @@
+/* Authors: Berck Nash, Elijah Ricca
+   Class: Applied Cryptography, Spring 2012
+   file: tracedec.c
+
+   ccm-trace: decodes a trace ring dump into text, or into Chrome trace
+   JSON (load in chrome://tracing or Perfetto) with --chrome.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "ccm.h"
+
+#define PRINT_USAGE {							\
+	  printf("ccm-trace usage:\n");					\
+	  printf("%s [--chrome|-c] TRACE_FILE\n",argv[0]);		\
+     }									\
+
+#define MAX_THREADS 1024
+
+static char *ops[] = { "encrypt", "decrypt" };
+static char *stages[] = { "format", "mac", "keystream", "xor" };
+static char *backends[] = { "aes", "evp" };
+
+/* last START/STAGE timestamp seen per thread, to turn stage markers into
+   spans */
+typedef struct {
+     uint32_t tid;
+     uint64_t start, mark;
+} span_t;
+
+static span_t spans[MAX_THREADS];
+static int nspans;
+
+static span_t *span_for(uint32_t tid)
+{
+     int i;
+     for (i=0; i < nspans; i++)
+	  if (spans[i].tid == tid)
+	       return &spans[i];
+     if (nspans == MAX_THREADS)
+	  fatal("Too many threads in trace.");
+     spans[nspans].tid = tid;
+     return &spans[nspans++];
+}
+
+static int by_time(const void *a, const void *b)
+{
+     const trace_event_t *x = a, *y = b;
+     return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+/* drop events torn by a dump racing the writer */
+static int valid(trace_event_t *ev)
+{
+     if (ev->type > TRACE_AUTH_FAIL || ev->op > TRACE_DECRYPT || ev->backend > BACKEND_EVP)
+	  return 0;
+     return ev->type != TRACE_STAGE || ev->arg0 <= STAGE_XOR;
+}
+
+static void print_text(trace_event_t *ev, uint64_t base)
+{
+     printf("%14.3f us\ttid %u\t%s\t", (ev->ts - base) / 1e3, ev->tid, ops[ev->op]);
+     switch (ev->type) {
+     case TRACE_START:
+	  printf("start\tlen %lu\tadata %lu\tbackend %s\tthreads %d\n",
+		 ev->arg0, ev->arg1, backends[ev->backend], ev->threads);
+	  break;
+     case TRACE_STAGE:
+	  printf("%s done\n", stages[ev->arg0]);
+	  break;
+     case TRACE_END:
+	  printf("end\tlen %lu\n", ev->arg0);
+	  break;
+     case TRACE_AUTH_FAIL:
+	  printf("AUTH FAILURE\n");
+	  break;
+     }
+}
+
+static void print_chrome(trace_event_t *ev, uint32_t pid, uint64_t base, int *first)
+{
+     span_t *span = span_for(ev->tid);
+     double ts = (ev->ts - base) / 1e3;
+
+     switch (ev->type) {
+     case TRACE_START:
+	  span->start = span->mark = ev->ts;
+	  return;
+     case TRACE_STAGE:
+	  if (!span->mark)
+	       return; //started before the ring's oldest event
+	  printf("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+		 "\"ts\":%.3f,\"dur\":%.3f}",
+		 *first ? "" : ",", stages[ev->arg0], ops[ev->op], pid, ev->tid,
+		 (span->mark - base) / 1e3, (ev->ts - span->mark) / 1e3);
+	  span->mark = ev->ts;
+	  break;
+     case TRACE_END:
+	  if (!span->start)
+	       return;
+	  printf("%s\n{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+		 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"len\":%lu,\"backend\":\"%s\",\"threads\":%d}}",
+		 *first ? "" : ",", ops[ev->op], pid, ev->tid,
+		 (span->start - base) / 1e3, (ev->ts - span->start) / 1e3,
+		 ev->arg0, backends[ev->backend], ev->threads);
+	  span->start = span->mark = 0;
+	  break;
+     case TRACE_AUTH_FAIL:
+	  printf("%s\n{\"name\":\"auth failure\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+		 *first ? "" : ",", pid, ev->tid, ts);
+	  break;
+     }
+     *first = 0;
+}
+
+int main(int argc, char *argv[])
+{
+     FILE *file;
+     trace_dump_header_t header;
+     trace_event_t *events;
+     unsigned long count, i, n = 0;
+     long size;
+     int opt, option_index;
+     int chrome = 0;
+     int first = 1;
+
+     static struct option long_options[] = {
+	  {"chrome",		no_argument,		0, 'c'},
+	  {"help",		no_argument,		0, 'h'},
+	  {0, 0, 0, 0}
+     };
+
+     while ((opt = getopt_long (argc, argv, "ch?",
+				long_options, &option_index)) != -1 ) {
+	  switch (opt) {
+	  case 'c':
+	       chrome = 1;
+	       break;
+	  case 'h': //intentional fall-through
+	  case '?':
+	       PRINT_USAGE;
+	       exit(0);
+	  }
+     }
+     if (optind != argc - 1) {
+	  PRINT_USAGE;
+	  exit(1);
+     }
+
+     file = fopen(argv[optind], "rb");
+     if (!file)
+	  fatal("Error opening trace file for reading.");
+     fseek(file, 0L, SEEK_END);
+     size = ftell(file);
+     rewind(file);
+
+     if (fread(&header, sizeof(header), 1, file) != 1
+	 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)))
+	  fatal("Not a ccm trace file.");
+     if (header.version != TRACE_VERSION)
+	  fatal("Unsupported trace file version.");
+
+     count = (size - sizeof(header)) / sizeof(trace_event_t);
+     events = malloc(count * sizeof(trace_event_t) + 1);
+     if (!events)
+	  fatal("Error allocating memory for trace events.");
+     count = fread(events, sizeof(trace_event_t), count, file);
+     fclose(file);
+
+     for (i=0; i < count; i++)
+	  if (valid(&events[i]))
+	       events[n++] = events[i];
+     qsort(events, n, sizeof(trace_event_t), by_time);
+
+     if (chrome)
+	  printf("{\"traceEvents\":[");
+     for (i=0; i < n; i++) {
+	  if (chrome)
+	       print_chrome(&events[i], header.pid, events[0].ts, &first);
+	  else
+	       print_text(&events[i], events[0].ts);
+     }
+     if (chrome)
+	  printf("\n]}\n");
+
+     free(events);
+     return 0;
+}
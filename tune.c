@@ -0,0 +1,239 @@
+/* Authors: Berck Nash, Elijah Ricca
+   Class: Applied Cryptography, Spring 2012
+   file: tune.c
+
+   Tuning profile handling and the startup autotuner
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ccm.h"
+
+#define TUNE_PAYLOAD (1 << 20) //bytes encrypted per benchmark message
+#define TUNE_SMALL 16 //smallest payload tried when looking for the EVP cutoff
+#define TUNE_ADATA 16
+#define TUNE_NONCE 11
+
+/* safe defaults, matching the original single-threaded behaviour */
+ccm_config_t ccm_config = { BACKEND_AES, 1, 4096, 0 };
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static char *config_filename;
+
+static void config_load(void)
+{
+     char *filename = config_filename;
+
+     if (!filename)
+	  filename = getenv("CCM_PROFILE");
+     if (!filename)
+	  filename = DEFAULT_PROFILE;
+     load_profile(filename);
+     keystream_pool(ccm_config.threads);
+     trace_init();
+}
+
+void ccm_init(char *filename)
+{
+     if (filename)
+	  config_filename = filename;
+     pthread_once(&config_once, config_load);
+}
+
+/* Read a profile of "name value" lines into ccm_config.  A missing file
+   leaves the defaults in place; bad entries are reported and skipped.
+   Returns 0 if the file was read, -1 otherwise. */
+int load_profile(char *filename)
+{
+     FILE *file;
+     char line[128], name[32], value[32];
+     long n;
+
+     file = fopen(filename, "r");
+     if (!file) {
+	  errno = 0;
+	  return -1;
+     }
+
+     while (fgets(line, sizeof(line), file)) {
+	  if (line[0] == '#' || sscanf(line, "%31s %31s", name, value) != 2)
+	       continue;
+	  if (!strcmp(name, "backend")) {
+	       if (!strcmp(value, "aes"))
+		    ccm_config.backend = BACKEND_AES;
+	       else if (!strcmp(value, "evp"))
+		    ccm_config.backend = BACKEND_EVP;
+	       else
+		    error("Unknown backend in tuning profile, ignoring.");
+	  }
+	  else if (!strcmp(name, "threads")) {
+	       n = strtol(value, NULL, 10);
+	       if (n >= 1 && n <= 256)
+		    ccm_config.threads = n;
+	       else
+		    error("Bad thread count in tuning profile, ignoring.");
+	  }
+	  else if (!strcmp(name, "chunk")) {
+	       n = strtol(value, NULL, 10);
+	       if (n >= 1)
+		    ccm_config.chunk = n;
+	       else
+		    error("Bad chunk size in tuning profile, ignoring.");
+	  }
+	  else if (!strcmp(name, "evp_min_blocks")) {
+	       n = strtol(value, NULL, 10);
+	       if (n >= 0)
+		    ccm_config.evp_min_blocks = n;
+	       else
+		    error("Bad EVP cutoff in tuning profile, ignoring.");
+	  }
+     }
+     fclose(file);
+     return 0;
+}
+
+void save_profile(char *filename)
+{
+     FILE *file;
+
+     file = fopen(filename, "w");
+     if (!file)
+	  fatal("Error opening tuning profile for writing.");
+     fprintf(file, "# written by ccm --tune\n");
+     fprintf(file, "backend %s\n", ccm_config.backend == BACKEND_EVP ? "evp" : "aes");
+     fprintf(file, "threads %d\n", ccm_config.threads);
+     fprintf(file, "chunk %lu\n", ccm_config.chunk);
+     fprintf(file, "evp_min_blocks %lu\n", ccm_config.evp_min_blocks);
+     if (fclose(file))
+	  fatal("Error writing tuning profile.");
+}
+
+static double now(void)
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Encrypt the benchmark message repeatedly for budget seconds under the
+   current ccm_config and return the throughput in MB/s. */
+static double bench(ccm_t *input, double budget)
+{
+     unsigned char *c;
+     int c_len;
+     unsigned long bytes = 0;
+     double start, elapsed;
+
+     start = now();
+     do {
+	  c = ccm_encrypt(&c_len, input);
+	  free(c);
+	  bytes += input->p_len;
+	  elapsed = now() - start;
+     } while (elapsed < budget);
+
+     return bytes / elapsed / 1e6;
+}
+
+/* Try every backend/threads/chunk combination on this host with a large
+   message, then, if EVP wins, find the message size below which the
+   per-call EVP setup makes AES faster.  Spends about seconds in total and
+   writes the result to filename. */
+void tune(char *filename, double seconds)
+{
+     static const unsigned long chunks[] = { 256, 1024, 4096, 16384 };
+     int nchunks = sizeof(chunks) / sizeof(chunks[0]);
+     ccm_config_t candidates[128], best;
+     int count = 0;
+     int backend, threads, i;
+     long cpus;
+     unsigned long size;
+     double rate, best_rate = 0, aes_rate, budget;
+     ccm_t input;
+
+     /* load any existing profile now so it can't clobber the candidates */
+     ccm_init(filename);
+
+     cpus = sysconf(_SC_NPROCESSORS_ONLN);
+     if (cpus < 1)
+	  cpus = 1;
+     if (cpus > 256)
+	  cpus = 256;
+
+     for (backend = BACKEND_AES; backend <= BACKEND_EVP; backend++)
+	  for (threads = 1; threads <= cpus; threads *= 2) {
+	       if (threads == 1) {
+		    candidates[count++] = (ccm_config_t) { backend, 1, chunks[0], 0 };
+		    continue;
+	       }
+	       for (i=0; i < nchunks; i++)
+		    candidates[count++] = (ccm_config_t) { backend, threads, chunks[i], 0 };
+	  }
+
+     input.t_len = 16;
+     input.a_len = TUNE_ADATA;
+     input.n_len = TUNE_NONCE;
+     input.p_len = TUNE_PAYLOAD;
+     input.prepared = NULL;
+     input.arena = NULL;
+     input.out = NULL;
+     input.key = calloc(16, 1);
+     input.adata = calloc(TUNE_ADATA, 1);
+     input.nonce = calloc(TUNE_NONCE, 1);
+     input.payload = calloc(TUNE_PAYLOAD, 1);
+     if (!input.key || !input.adata || !input.nonce || !input.payload)
+	  fatal("Error allocating memory for tuning buffers.");
+
+     /* three quarters of the time on the grid, the rest on the cutoff */
+     printf("tuning %d configurations for %.1f seconds\n", count, seconds);
+     best = ccm_config;
+     budget = 0.75 * seconds / count;
+     for (i=0; i < count; i++) {
+	  ccm_config = candidates[i];
+	  keystream_pool(ccm_config.threads);
+	  rate = bench(&input, budget);
+	  printf("backend %s\tthreads %d\tchunk %lu\t%9.1f MB/s\n",
+		 ccm_config.backend == BACKEND_EVP ? "evp" : "aes",
+		 ccm_config.threads, ccm_config.chunk, rate);
+	  if (rate > best_rate) {
+	       best_rate = rate;
+	       best = candidates[i];
+	  }
+     }
+
+     /* sizes are powers of four; EVP is used from the smallest size at
+	which it beats AES for that size and every larger one */
+     if (best.backend == BACKEND_EVP) {
+	  for (i=0, size = TUNE_PAYLOAD; size >= TUNE_SMALL; size /= 4)
+	       i += 2;
+	  budget = 0.25 * seconds / i;
+	  best.evp_min_blocks = 1 + (TUNE_PAYLOAD + 15) / 16;
+	  for (size = TUNE_PAYLOAD; size >= TUNE_SMALL; size /= 4) {
+	       input.p_len = size;
+	       ccm_config = best;
+	       ccm_config.backend = BACKEND_AES;
+	       aes_rate = bench(&input, budget);
+	       ccm_config.backend = BACKEND_EVP;
+	       ccm_config.evp_min_blocks = 0;
+	       rate = bench(&input, budget);
+	       printf("payload %lu\taes %9.1f MB/s\tevp %9.1f MB/s\n", size, aes_rate, rate);
+	       if (rate < aes_rate)
+		    break;
+	       best.evp_min_blocks = 1 + (size + 15) / 16; //counter blocks incl. the tag's
+	  }
+     }
+
+     ccm_config = best;
+     save_profile(filename);
+     printf("wrote %s\n", filename);
+
+     free(input.key);
+     free(input.adata);
+     free(input.nonce);
+     free(input.payload);
+}